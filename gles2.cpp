@@ -5,14 +5,33 @@
 #include <thread>
 #include <chrono>
 #include <deque>
+#include <algorithm>
+#include <list>
+#include <numeric>
+#include <type_traits>
+#include <unordered_map>
+#include <initializer_list>
 #include "lodepng/lodepng.h"
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MATRIX_SIMD_NEON
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define MATRIX_SIMD_SSE2
+#endif
+#include <sstream>
+#ifdef MATRIX_BENCHMARK
+#include <functional>
+#endif
 #ifndef _WIN32
 #include <iostream>
-#ifdef TFT_OUTPUT
 #include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef TFT_OUTPUT
 #include <linux/fb.h>
 #include <sys/ioctl.h>
-#include <sys/mman.h>
 #endif
 #include <SDL.h>
 #include <EGL/egl.h>
@@ -28,24 +47,50 @@
 
 #ifndef _MSC_VER
 using std::min;
+using std::max;
 #endif
 
-#define NUMBER_OF_PARTICLES 16
+#define DEFAULT_NUMBER_OF_PARTICLES 16
+#define PARTICLE_MAX_SCALE 1.1f
+// Life deltas are multiples of 1/100, so over this period every particle advances
+// a multiple of the cycle wrap used in particle_gpu.vs
+#define PARTICLE_CYCLE_WRAP 8
+#define PARTICLE_TIME_PERIOD (PARTICLE_CYCLE_WRAP * 100.0)
+#define SIMULATION_STEP 0.01f
+#define SIMULATION_MAX_STEPS 25
+#define DEFAULT_FRAME_RATE 60
+#define GL_STATE_TEXTURE_UNITS 8
+#define GL_STATE_VERTEX_ATTRIBS 32
+#define STATISTICS_INTERVAL 1.0f
+#define WINDOW_EVENT_TIMEOUT 100
+#define WINDOW_EVENT_POLL_INTERVAL 10
+#define DAMAGE_HISTORY_FRAMES 4
+#define DAMAGE_MARGIN 1
+#define QUAD_INDEX_MAX_QUADS 16384
+#define STREAM_BUFFER_SEGMENTS 3
+#define STREAM_BUFFER_SEGMENT_SIZE 65536
+#define STREAM_BUFFER_ALIGNMENT 16
 
 #ifdef _WIN32
 PFNGLACTIVETEXTUREPROC glActiveTexture;
 PFNGLATTACHSHADERPROC glAttachShader;
 PFNGLBINDBUFFERPROC glBindBuffer;
+PFNGLBINDFRAMEBUFFERPROC glBindFramebuffer;
 PFNGLBUFFERDATAPROC glBufferData;
+PFNGLBUFFERSUBDATAPROC glBufferSubData;
+PFNGLCHECKFRAMEBUFFERSTATUSPROC glCheckFramebufferStatus;
 PFNGLCOMPILESHADERPROC glCompileShader;
 PFNGLCREATEPROGRAMPROC glCreateProgram;
 PFNGLCREATESHADERPROC glCreateShader;
 PFNGLDELETEBUFFERSPROC glDeleteBuffers;
+PFNGLDELETEFRAMEBUFFERSPROC glDeleteFramebuffers;
 PFNGLDELETEPROGRAMPROC glDeleteProgram;
 PFNGLDELETESHADERPROC glDeleteShader;
 PFNGLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray;
 PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray;
+PFNGLFRAMEBUFFERTEXTURE2DPROC glFramebufferTexture2D;
 PFNGLGENBUFFERSPROC glGenBuffers;
+PFNGLGENFRAMEBUFFERSPROC glGenFramebuffers;
 PFNGLGETATTRIBLOCATIONPROC glGetAttribLocation;
 PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation;
 PFNGLGETPROGRAMINFOLOGPROC glGetProgramInfoLog;
@@ -69,6 +114,7 @@ class Window
             NoEvent,
             KeyPressedEsc,
             WindowClosed,
+            WindowExposed,
             ApplicationTerminated
         };
 
@@ -83,8 +129,11 @@ class Window
         static Window &GetInstance();
         void Close();
         bool SwapBuffers();
+        bool SetSwapInterval(int interval);
         void GetClientSize(unsigned &width, unsigned &height) const;
-        Event GetEvent();
+        unsigned GetBufferAge() const;
+        void SetDamageRegion(GLint x, GLint y, GLsizei width, GLsizei height);
+        Event GetEvent(bool wait = false);
     private:
 #ifndef _WIN32
         DISPMANX_DISPLAY_HANDLE_T dispmanDisplay;
@@ -92,7 +141,10 @@ class Window
         EGLDisplay eglDisplay;
         EGLContext eglContext;
         EGLSurface eglSurface;
-        bool quit;
+        bool quit, bufferAgeSupported;
+#ifdef EGL_KHR_partial_update
+        PFNEGLSETDAMAGEREGIONKHRPROC eglSetDamageRegion;
+#endif
 #ifdef TFT_OUTPUT
         DISPMANX_RESOURCE_HANDLE_T dispmanResource;
         unsigned fbMemSize, fbLineSize;
@@ -402,6 +454,15 @@ Window::Window()
     }
 
     quit = false;
+
+    std::string extensions = std::string(" ") + eglQueryString(eglDisplay, EGL_EXTENSIONS) + std::string(" ");
+    bufferAgeSupported = (extensions.find(" EGL_EXT_buffer_age ") != std::string::npos) || (extensions.find(" EGL_KHR_partial_update ") != std::string::npos);
+#ifdef EGL_KHR_partial_update
+    eglSetDamageRegion = nullptr;
+    if (extensions.find(" EGL_KHR_partial_update ") != std::string::npos) {
+        eglSetDamageRegion = reinterpret_cast<PFNEGLSETDAMAGEREGIONKHRPROC>(eglGetProcAddress("eglSetDamageRegionKHR"));
+    }
+#endif
 #else
     if (!wglMakeCurrent(hDC, hRC)) {
         wglDeleteContext(hRC);
@@ -499,17 +560,59 @@ bool Window::SwapBuffers()
 #endif
 }
 
-Window::Event Window::GetEvent()
+bool Window::SetSwapInterval(int interval)
+{
+#ifndef _WIN32
+    return eglSwapInterval(eglDisplay, interval) == EGL_TRUE;
+#else
+    PFNWGLSWAPINTERVALEXTPROC wglSwapIntervalEXT = reinterpret_cast<PFNWGLSWAPINTERVALEXTPROC>(wglGetProcAddress("wglSwapIntervalEXT"));
+    if (wglSwapIntervalEXT == nullptr) {
+        return false;
+    }
+    return wglSwapIntervalEXT(interval) == TRUE;
+#endif
+}
+
+unsigned Window::GetBufferAge() const
+{
+#if !defined(_WIN32) && defined(EGL_BUFFER_AGE_EXT)
+    EGLint age;
+    if (bufferAgeSupported && (eglQuerySurface(eglDisplay, eglSurface, EGL_BUFFER_AGE_EXT, &age) == EGL_TRUE)) {
+        return static_cast<unsigned>(age);
+    }
+#endif
+    return 0;
+}
+
+void Window::SetDamageRegion(GLint x, GLint y, GLsizei width, GLsizei height)
+{
+#if !defined(_WIN32) && defined(EGL_KHR_partial_update)
+    if (eglSetDamageRegion != nullptr) {
+        EGLint rect[] = { x, y, width, height };
+        eglSetDamageRegion(eglDisplay, eglSurface, rect, 1);
+    }
+#endif
+}
+
+Window::Event Window::GetEvent(bool wait)
 {
 #ifndef _WIN32
     SDL_Event event;
-    if (SDL_PollEvent(&event)) {
+    bool received = SDL_PollEvent(&event);
+    for (unsigned waited = 0; wait && !received && !quit && (waited < WINDOW_EVENT_TIMEOUT); waited += WINDOW_EVENT_POLL_INTERVAL) {
+        SDL_Delay(WINDOW_EVENT_POLL_INTERVAL);
+        received = SDL_PollEvent(&event);
+    }
+    if (received) {
         if ((event.type == SDL_KEYDOWN) && (event.key.keysym.sym == SDLK_ESCAPE)) {
             return Event::KeyPressedEsc;
         }
     } else if (quit) {
         return Event::ApplicationTerminated;
 #else
+    if (wait) {
+        MsgWaitForMultipleObjectsEx(0, NULL, WINDOW_EVENT_TIMEOUT, QS_ALLINPUT, MWMO_INPUTAVAILABLE);
+    }
     MSG msg;
     if (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE) > 0) {
         if (msg.message == WM_QUIT) {
@@ -542,16 +645,22 @@ void Window::InitGL() const
     glActiveTexture = InitGLFunction<PFNGLACTIVETEXTUREPROC>("glActiveTexture");
     glAttachShader = InitGLFunction<PFNGLATTACHSHADERPROC>("glAttachShader");
     glBindBuffer = InitGLFunction<PFNGLBINDBUFFERPROC>("glBindBuffer");
+    glBindFramebuffer = InitGLFunction<PFNGLBINDFRAMEBUFFERPROC>("glBindFramebuffer");
     glBufferData = InitGLFunction<PFNGLBUFFERDATAPROC>("glBufferData");
+    glBufferSubData = InitGLFunction<PFNGLBUFFERSUBDATAPROC>("glBufferSubData");
+    glCheckFramebufferStatus = InitGLFunction<PFNGLCHECKFRAMEBUFFERSTATUSPROC>("glCheckFramebufferStatus");
     glCompileShader = InitGLFunction<PFNGLCOMPILESHADERPROC>("glCompileShader");
     glCreateProgram = InitGLFunction<PFNGLCREATEPROGRAMPROC>("glCreateProgram");
     glCreateShader = InitGLFunction<PFNGLCREATESHADERPROC>("glCreateShader");
     glDeleteBuffers = InitGLFunction<PFNGLDELETEBUFFERSPROC>("glDeleteBuffers");
+    glDeleteFramebuffers = InitGLFunction<PFNGLDELETEFRAMEBUFFERSPROC>("glDeleteFramebuffers");
     glDeleteProgram = InitGLFunction<PFNGLDELETEPROGRAMPROC>("glDeleteProgram");
     glDeleteShader = InitGLFunction<PFNGLDELETESHADERPROC>("glDeleteShader");
     glDisableVertexAttribArray = InitGLFunction<PFNGLDISABLEVERTEXATTRIBARRAYPROC>("glDisableVertexAttribArray");
     glEnableVertexAttribArray = InitGLFunction<PFNGLENABLEVERTEXATTRIBARRAYPROC>("glEnableVertexAttribArray");
+    glFramebufferTexture2D = InitGLFunction<PFNGLFRAMEBUFFERTEXTURE2DPROC>("glFramebufferTexture2D");
     glGenBuffers = InitGLFunction<PFNGLGENBUFFERSPROC>("glGenBuffers");
+    glGenFramebuffers = InitGLFunction<PFNGLGENFRAMEBUFFERSPROC>("glGenFramebuffers");
     glGetAttribLocation = InitGLFunction<PFNGLGETATTRIBLOCATIONPROC>("glGetAttribLocation");
     glGetUniformLocation = InitGLFunction<PFNGLGETUNIFORMLOCATIONPROC>("glGetUniformLocation");
     glGetProgramInfoLog = InitGLFunction<PFNGLGETPROGRAMINFOLOGPROC>("glGetProgramInfoLog");
@@ -576,6 +685,10 @@ LRESULT CALLBACK Window::WindowProc(HWND hWnd, UINT msg, WPARAM wParam, LPARAM l
     } else if ((msg == WM_KEYDOWN) && (wParam == VK_ESCAPE)) {
         GetInstance().event = Event::KeyPressedEsc;
         return 0;
+    } else if (msg == WM_PAINT) {
+        ValidateRect(hWnd, NULL);
+        GetInstance().event = Event::WindowExposed;
+        return 0;
     } else if ((msg == WM_SETCURSOR) && (LOWORD(lParam) == HTCLIENT)) {
         SetCursor(NULL);
         return 0;
@@ -590,6 +703,443 @@ void Window::GetClientSize(unsigned &width, unsigned &height) const
     height = clientHeight;
 }
 
+class GLState
+{
+    public:
+        GLState(const GLState &) = delete;
+        GLState(GLState &&) = delete;
+        GLState &operator=(const GLState &) = delete;
+        static GLState &GetInstance();
+
+        void UseProgram(GLuint program);
+        void ActiveTexture(GLenum unit);
+        void BindTexture(GLuint texture);
+        void BindBuffer(GLenum target, GLuint buffer);
+        void Enable(GLenum capability);
+        void Disable(GLenum capability);
+        bool IsEnabled(GLenum capability) const;
+        void BlendFunc(GLenum sourceFactor, GLenum destinationFactor);
+        void SetVertexAttribArrays(std::initializer_list<GLuint> attributes);
+
+        void InvalidateProgram(GLuint program);
+        void InvalidateTexture(GLuint texture);
+        void InvalidateBuffer(GLuint buffer);
+
+        unsigned GetIssuedCalls() const;
+        unsigned GetFilteredCalls() const;
+        void ResetStatistics();
+    private:
+        GLuint program, activeTexture, arrayBuffer, elementArrayBuffer;
+        GLuint textures[GL_STATE_TEXTURE_UNITS];
+        GLenum blendSourceFactor, blendDestinationFactor;
+        uint32_t vertexAttribArrays;
+        std::unordered_map<GLenum, bool> capabilities;
+        unsigned issuedCalls, filteredCalls;
+
+        GLState();
+        bool Filter(bool redundant);
+};
+
+GLState::GLState() :
+    program(0), activeTexture(0), arrayBuffer(0), elementArrayBuffer(0), blendSourceFactor(GL_ONE), blendDestinationFactor(GL_ZERO),
+    vertexAttribArrays(0), issuedCalls(0), filteredCalls(0)
+{
+    std::memset(textures, 0, sizeof(textures));
+}
+
+GLState &GLState::GetInstance()
+{
+    static GLState instance;
+    return instance;
+}
+
+bool GLState::Filter(bool redundant)
+{
+    if (redundant) {
+        filteredCalls++;
+    } else {
+        issuedCalls++;
+    }
+    return redundant;
+}
+
+void GLState::UseProgram(GLuint program)
+{
+    if (Filter(this->program == program)) {
+        return;
+    }
+    this->program = program;
+    glUseProgram(program);
+}
+
+void GLState::ActiveTexture(GLenum unit)
+{
+    if (Filter(activeTexture == unit - GL_TEXTURE0)) {
+        return;
+    }
+    activeTexture = unit - GL_TEXTURE0;
+    glActiveTexture(unit);
+}
+
+void GLState::BindTexture(GLuint texture)
+{
+    if (activeTexture >= GL_STATE_TEXTURE_UNITS) {
+        Filter(false);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        return;
+    }
+    if (Filter(textures[activeTexture] == texture)) {
+        return;
+    }
+    textures[activeTexture] = texture;
+    glBindTexture(GL_TEXTURE_2D, texture);
+}
+
+void GLState::BindBuffer(GLenum target, GLuint buffer)
+{
+    GLuint &bound = (target == GL_ELEMENT_ARRAY_BUFFER) ? elementArrayBuffer : arrayBuffer;
+    if (Filter(bound == buffer)) {
+        return;
+    }
+    bound = buffer;
+    glBindBuffer(target, buffer);
+}
+
+void GLState::Enable(GLenum capability)
+{
+    auto state = capabilities.find(capability);
+    if (Filter((state != capabilities.end()) && state->second)) {
+        return;
+    }
+    capabilities[capability] = true;
+    glEnable(capability);
+}
+
+void GLState::Disable(GLenum capability)
+{
+    auto state = capabilities.find(capability);
+    if (Filter((state != capabilities.end()) && !state->second)) {
+        return;
+    }
+    capabilities[capability] = false;
+    glDisable(capability);
+}
+
+bool GLState::IsEnabled(GLenum capability) const
+{
+    auto state = capabilities.find(capability);
+    return (state != capabilities.end()) && state->second;
+}
+
+void GLState::BlendFunc(GLenum sourceFactor, GLenum destinationFactor)
+{
+    if (Filter((blendSourceFactor == sourceFactor) && (blendDestinationFactor == destinationFactor))) {
+        return;
+    }
+    blendSourceFactor = sourceFactor;
+    blendDestinationFactor = destinationFactor;
+    glBlendFunc(sourceFactor, destinationFactor);
+}
+
+void GLState::SetVertexAttribArrays(std::initializer_list<GLuint> attributes)
+{
+    uint32_t enabled = 0;
+    for (GLuint attribute : attributes) {
+        if (attribute < GL_STATE_VERTEX_ATTRIBS) {
+            enabled |= 1u << attribute;
+        }
+    }
+    for (GLuint attribute = 0; attribute < GL_STATE_VERTEX_ATTRIBS; attribute++) {
+        uint32_t bit = 1u << attribute;
+        if ((enabled & bit) == (vertexAttribArrays & bit)) {
+            if (enabled & bit) {
+                Filter(true);
+            }
+            continue;
+        }
+        Filter(false);
+        if (enabled & bit) {
+            glEnableVertexAttribArray(attribute);
+        } else {
+            glDisableVertexAttribArray(attribute);
+        }
+    }
+    vertexAttribArrays = enabled;
+}
+
+void GLState::InvalidateProgram(GLuint program)
+{
+    if (this->program == program) {
+        this->program = 0;
+    }
+}
+
+void GLState::InvalidateTexture(GLuint texture)
+{
+    for (GLuint i = 0; i < GL_STATE_TEXTURE_UNITS; i++) {
+        if (textures[i] == texture) {
+            textures[i] = 0;
+        }
+    }
+}
+
+void GLState::InvalidateBuffer(GLuint buffer)
+{
+    if (arrayBuffer == buffer) {
+        arrayBuffer = 0;
+    }
+    if (elementArrayBuffer == buffer) {
+        elementArrayBuffer = 0;
+    }
+}
+
+unsigned GLState::GetIssuedCalls() const
+{
+    return issuedCalls;
+}
+
+unsigned GLState::GetFilteredCalls() const
+{
+    return filteredCalls;
+}
+
+void GLState::ResetStatistics()
+{
+    issuedCalls = 0;
+    filteredCalls = 0;
+}
+
+class QuadIndexBuffer
+{
+    public:
+        QuadIndexBuffer(const QuadIndexBuffer &) = delete;
+        QuadIndexBuffer(QuadIndexBuffer &&) = delete;
+        QuadIndexBuffer &operator=(const QuadIndexBuffer &) = delete;
+        static QuadIndexBuffer &GetInstance();
+
+        template <typename BindVertices>
+        void Draw(GLsizei quads, BindVertices bindVertices);
+    private:
+        GLuint buffer;
+        GLsizei capacity;
+
+        QuadIndexBuffer();
+        void Reserve(GLsizei quads);
+};
+
+QuadIndexBuffer::QuadIndexBuffer() :
+    capacity(0)
+{
+    glGenBuffers(1, &buffer);
+}
+
+QuadIndexBuffer &QuadIndexBuffer::GetInstance()
+{
+    static QuadIndexBuffer instance;
+    return instance;
+}
+
+void QuadIndexBuffer::Reserve(GLsizei quads)
+{
+    if (quads <= capacity) {
+        return;
+    }
+    capacity = min(max(quads, capacity * 2), static_cast<GLsizei>(QUAD_INDEX_MAX_QUADS));
+    std::vector<GLushort> indices(capacity * 6);
+    for (GLsizei i = 0; i < capacity; i++) {
+        GLushort vertex = static_cast<GLushort>(i * 4);
+        GLushort quad[] = { vertex, static_cast<GLushort>(vertex + 1), static_cast<GLushort>(vertex + 2), vertex, static_cast<GLushort>(vertex + 2), static_cast<GLushort>(vertex + 3) };
+        std::memcpy(&indices[i * 6], quad, sizeof(quad));
+    }
+    GLState::GetInstance().BindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(GLushort), indices.data(), GL_STATIC_DRAW);
+}
+
+template <typename BindVertices>
+void QuadIndexBuffer::Draw(GLsizei quads, BindVertices bindVertices)
+{
+    Reserve(min(quads, static_cast<GLsizei>(QUAD_INDEX_MAX_QUADS)));
+    GLState::GetInstance().BindBuffer(GL_ELEMENT_ARRAY_BUFFER, buffer);
+    for (GLsizei first = 0; first < quads; first += QUAD_INDEX_MAX_QUADS) {
+        bindVertices(first * 4);
+        glDrawElements(GL_TRIANGLES, min(quads - first, static_cast<GLsizei>(QUAD_INDEX_MAX_QUADS)) * 6, GL_UNSIGNED_SHORT, (GLvoid *)0);
+    }
+}
+
+class StreamBuffer
+{
+    public:
+        StreamBuffer(const StreamBuffer &) = delete;
+        StreamBuffer(StreamBuffer &&) = delete;
+        StreamBuffer &operator=(const StreamBuffer &) = delete;
+        static StreamBuffer &GetInstance();
+
+        size_t Write(const GLvoid *data, size_t size);
+        GLuint GetBuffer() const;
+        void NextFrame();
+    private:
+        GLuint buffer;
+        size_t segmentSize, offset;
+        unsigned segment;
+
+        StreamBuffer();
+        void Orphan();
+};
+
+StreamBuffer::StreamBuffer() :
+    segmentSize(STREAM_BUFFER_SEGMENT_SIZE), offset(0), segment(0)
+{
+    glGenBuffers(1, &buffer);
+    Orphan();
+}
+
+StreamBuffer &StreamBuffer::GetInstance()
+{
+    static StreamBuffer instance;
+    return instance;
+}
+
+void StreamBuffer::Orphan()
+{
+    GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, segmentSize * STREAM_BUFFER_SEGMENTS, nullptr, GL_STREAM_DRAW);
+}
+
+size_t StreamBuffer::Write(const GLvoid *data, size_t size)
+{
+    size_t start = (offset + STREAM_BUFFER_ALIGNMENT - 1) & ~static_cast<size_t>(STREAM_BUFFER_ALIGNMENT - 1);
+    if (start + size > segmentSize) {
+        while (segmentSize < start + size) {
+            segmentSize *= 2;
+        }
+        segment = 0;
+        start = 0;
+        Orphan();
+    } else {
+        GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, buffer);
+    }
+    size_t position = segment * segmentSize + start;
+    glBufferSubData(GL_ARRAY_BUFFER, position, size, data);
+    offset = start + size;
+    return position;
+}
+
+GLuint StreamBuffer::GetBuffer() const
+{
+    return buffer;
+}
+
+void StreamBuffer::NextFrame()
+{
+    segment = (segment + 1) % STREAM_BUFFER_SEGMENTS;
+    offset = 0;
+    if (!segment) {
+        Orphan();
+    }
+}
+
+struct ScreenRect
+{
+    GLfloat left, bottom, right, top;
+};
+
+class DamageTracker
+{
+    public:
+        DamageTracker(unsigned width, unsigned height);
+
+        void Add(const ScreenRect &rect);
+        void AddScreen();
+        bool IsEmpty() const;
+        void Begin();
+        void End();
+    private:
+        struct PixelRect
+        {
+            GLint left, bottom, right, top;
+        };
+
+        std::deque<PixelRect> history;
+        PixelRect damage;
+        GLint width, height;
+
+        static void Merge(PixelRect &rect, const PixelRect &other);
+};
+
+DamageTracker::DamageTracker(unsigned width, unsigned height) :
+    damage({ 0, 0, 0, 0 }), width(static_cast<GLint>(width)), height(static_cast<GLint>(height))
+{
+}
+
+void DamageTracker::Merge(PixelRect &rect, const PixelRect &other)
+{
+    if ((other.left >= other.right) || (other.bottom >= other.top)) {
+        return;
+    }
+    if ((rect.left >= rect.right) || (rect.bottom >= rect.top)) {
+        rect = other;
+        return;
+    }
+    rect.left = min(rect.left, other.left);
+    rect.bottom = min(rect.bottom, other.bottom);
+    rect.right = max(rect.right, other.right);
+    rect.top = max(rect.top, other.top);
+}
+
+void DamageTracker::Add(const ScreenRect &rect)
+{
+    PixelRect pixels = {
+        max(static_cast<GLint>(floor((rect.left + 1.0f) * 0.5f * width)) - DAMAGE_MARGIN, 0),
+        max(static_cast<GLint>(floor((rect.bottom + 1.0f) * 0.5f * height)) - DAMAGE_MARGIN, 0),
+        min(static_cast<GLint>(ceil((rect.right + 1.0f) * 0.5f * width)) + DAMAGE_MARGIN, width),
+        min(static_cast<GLint>(ceil((rect.top + 1.0f) * 0.5f * height)) + DAMAGE_MARGIN, height)
+    };
+    Merge(damage, pixels);
+}
+
+void DamageTracker::AddScreen()
+{
+    damage = { 0, 0, width, height };
+}
+
+bool DamageTracker::IsEmpty() const
+{
+    return (damage.left >= damage.right) || (damage.bottom >= damage.top);
+}
+
+void DamageTracker::Begin()
+{
+    Window &window = Window::GetInstance();
+    unsigned age = window.GetBufferAge();
+    PixelRect area = damage;
+    if (!age || (age > history.size() + 1)) {
+        area = { 0, 0, width, height };
+    } else {
+        for (unsigned i = 0; i + 1 < age; i++) {
+            Merge(area, history[i]);
+        }
+    }
+    window.SetDamageRegion(area.left, area.bottom, area.right - area.left, area.top - area.bottom);
+
+    GLState &state = GLState::GetInstance();
+    if ((area.left > 0) || (area.bottom > 0) || (area.right < width) || (area.top < height)) {
+        state.Enable(GL_SCISSOR_TEST);
+        glScissor(area.left, area.bottom, area.right - area.left, area.top - area.bottom);
+    } else {
+        state.Disable(GL_SCISSOR_TEST);
+    }
+}
+
+void DamageTracker::End()
+{
+    history.push_front(damage);
+    if (history.size() > DAMAGE_HISTORY_FRAMES) {
+        history.pop_back();
+    }
+    damage = { 0, 0, 0, 0 };
+    GLState::GetInstance().Disable(GL_SCISSOR_TEST);
+}
+
 class ShaderProgram
 {
     public:
@@ -660,6 +1210,7 @@ ShaderProgram::ShaderProgram(const char *vertexShaderSrc, const char *fragmentSh
 
 ShaderProgram::~ShaderProgram()
 {
+    GLState::GetInstance().InvalidateProgram(program);
     glDeleteProgram(program);
     glDeleteShader(fragmentShader);
     glDeleteShader(vertexShader);
@@ -750,7 +1301,7 @@ Texture::Texture(const std::string &filename)
         throw std::runtime_error("Cannot load texture");
     }
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    GLState::GetInstance().BindTexture(texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image.data());
@@ -760,7 +1311,7 @@ Texture::Texture(GLuint width, GLuint height, GLchar *data) :
     width(width), height(height)
 {
     glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
+    GLState::GetInstance().BindTexture(texture);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
@@ -768,6 +1319,7 @@ Texture::Texture(GLuint width, GLuint height, GLchar *data) :
 
 Texture::~Texture()
 {
+    GLState::GetInstance().InvalidateTexture(texture);
     glDeleteTextures(1, &texture);
 }
 
@@ -786,41 +1338,221 @@ GLuint Texture::GetHeight() const
     return height;
 }
 
-class Matrix
+const GLfloat layerQuadData[] = {
+    -1.0f, -1.0f, 0.0f, 0.0f,
+    1.0f, -1.0f, 1.0f, 0.0f,
+    1.0f, 1.0f, 1.0f, 1.0f,
+    -1.0f, 1.0f, 0.0f, 1.0f
+};
+
+class LayerCache
 {
     public:
-        enum class Rotation {
-            AxisX,
-            AxisY,
-            AxisZ
-        };
+        LayerCache(const std::shared_ptr<ShaderProgram> &shader);
+        LayerCache(const LayerCache &) = delete;
+        LayerCache(LayerCache &&) = delete;
+        LayerCache &operator=(const LayerCache &) = delete;
+        virtual ~LayerCache();
+
+        void Resize(GLint width, GLint height);
+        void Invalidate();
+        template <typename RenderLayer>
+        void Draw(RenderLayer renderLayer);
+    private:
+        std::shared_ptr<ShaderProgram> shader;
+        GLuint framebuffer, texture, buffer, vertexAttribute, textureAttribute, textureUniform;
+        GLint width, height;
+        bool valid, supported;
 
-        Matrix();
-        Matrix(const Matrix &source);
-        Matrix(Matrix &&source) noexcept;
-        Matrix(GLuint width, GLuint height);
-        Matrix(GLuint width, GLuint height, GLfloat *matrixData);
+        bool Attach(GLenum type);
+};
 
-        std::shared_ptr<GLfloat> &GetData();
+LayerCache::LayerCache(const std::shared_ptr<ShaderProgram> &shader) :
+    shader(shader), width(0), height(0), valid(false), supported(false)
+{
+    vertexAttribute = glGetAttribLocation(shader->GetProgram(), "vertexPosition");
+    textureAttribute = glGetAttribLocation(shader->GetProgram(), "vertexTexture");
+    textureUniform = glGetUniformLocation(shader->GetProgram(), "texture");
 
-        void GetSize(GLuint &width, GLuint &height) const;
-        void SetSize(GLuint width, GLuint height);
+    glGenFramebuffers(1, &framebuffer);
+    glGenTextures(1, &texture);
+    glGenBuffers(1, &buffer);
 
-        Matrix operator+(const Matrix &matrix);
-        Matrix operator-(const Matrix &matrix);
-        Matrix operator*(const Matrix &matrix);
-        Matrix &operator=(const Matrix &source);
-        Matrix &operator=(const GLfloat *sourceData);
+    GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(layerQuadData), layerQuadData, GL_STATIC_DRAW);
+}
 
-        static Matrix GeneratePerpective(GLfloat width, GLfloat height, GLfloat nearPane, GLfloat farPane);
-        static Matrix GeneratePosition(GLfloat x, GLfloat y, GLfloat z);
-        static Matrix GenerateScale(GLfloat x, GLfloat y, GLfloat z);
-        static Matrix GenerateRotation(GLfloat angle, Rotation type);
-    private:
-        std::shared_ptr<GLfloat> data;
-        GLuint width;
-        GLuint height;
-};
+LayerCache::~LayerCache()
+{
+    GLState &state = GLState::GetInstance();
+    state.InvalidateTexture(texture);
+    state.InvalidateBuffer(buffer);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(1, &texture);
+    glDeleteBuffers(1, &buffer);
+}
+
+void LayerCache::Invalidate()
+{
+    valid = false;
+}
+
+bool LayerCache::Attach(GLenum type)
+{
+    GLState::GetInstance().BindTexture(texture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, type, nullptr);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    return status == GL_FRAMEBUFFER_COMPLETE;
+}
+
+void LayerCache::Resize(GLint width, GLint height)
+{
+    if ((width == this->width) && (height == this->height)) {
+        return;
+    }
+    this->width = width;
+    this->height = height;
+    valid = false;
+
+    GLState::GetInstance().BindTexture(texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    supported = Attach(GL_UNSIGNED_BYTE) || Attach(GL_UNSIGNED_SHORT_5_6_5);
+}
+
+template <typename RenderLayer>
+void LayerCache::Draw(RenderLayer renderLayer)
+{
+    if (!supported) {
+        renderLayer();
+        return;
+    }
+
+    GLState &state = GLState::GetInstance();
+    if (!valid) {
+        bool scissor = state.IsEnabled(GL_SCISSOR_TEST);
+        state.Disable(GL_SCISSOR_TEST);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, width, height);
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT);
+        renderLayer();
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+        if (scissor) {
+            state.Enable(GL_SCISSOR_TEST);
+        }
+        valid = true;
+    }
+
+    state.UseProgram(shader->GetProgram());
+    state.Disable(GL_BLEND);
+
+    state.ActiveTexture(GL_TEXTURE0);
+    state.BindTexture(texture);
+    glUniform1i(textureUniform, 0);
+
+    state.SetVertexAttribArrays({ vertexAttribute, textureAttribute });
+
+    state.BindBuffer(GL_ARRAY_BUFFER, buffer);
+    glVertexAttribPointer(vertexAttribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid *)0);
+    glVertexAttribPointer(textureAttribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid *)(2 * sizeof(GLfloat)));
+
+    QuadIndexBuffer::GetInstance().Draw(1, [](GLsizei) { });
+}
+
+void MultiplyMatrix(const GLfloat *left, GLuint leftWidth, GLuint leftHeight, const GLfloat *right, GLuint rightWidth, GLfloat *result)
+{
+    for (GLuint j = 0; j < leftHeight; j++) {
+        for (GLuint i = 0; i < rightWidth; i++) {
+            GLfloat m = 0.0f;
+            for (GLuint k = 0; k < leftWidth; k++) {
+                m += left[j + k * leftHeight] * right[k + i * leftWidth];
+            }
+            result[j + i * leftHeight] = m;
+        }
+    }
+}
+
+void MultiplyMatrix4(const GLfloat *left, const GLfloat *right, GLfloat *result)
+{
+#if defined(MATRIX_SIMD_NEON)
+    float32x4_t column0 = vld1q_f32(&left[0]);
+    float32x4_t column1 = vld1q_f32(&left[4]);
+    float32x4_t column2 = vld1q_f32(&left[8]);
+    float32x4_t column3 = vld1q_f32(&left[12]);
+    for (GLuint i = 0; i < 4; i++) {
+        float32x4_t m = vmulq_n_f32(column0, right[i * 4]);
+        m = vmlaq_n_f32(m, column1, right[i * 4 + 1]);
+        m = vmlaq_n_f32(m, column2, right[i * 4 + 2]);
+        m = vmlaq_n_f32(m, column3, right[i * 4 + 3]);
+        vst1q_f32(&result[i * 4], m);
+    }
+#elif defined(MATRIX_SIMD_SSE2)
+    __m128 column0 = _mm_loadu_ps(&left[0]);
+    __m128 column1 = _mm_loadu_ps(&left[4]);
+    __m128 column2 = _mm_loadu_ps(&left[8]);
+    __m128 column3 = _mm_loadu_ps(&left[12]);
+    for (GLuint i = 0; i < 4; i++) {
+        __m128 m = _mm_mul_ps(column0, _mm_set1_ps(right[i * 4]));
+        m = _mm_add_ps(m, _mm_mul_ps(column1, _mm_set1_ps(right[i * 4 + 1])));
+        m = _mm_add_ps(m, _mm_mul_ps(column2, _mm_set1_ps(right[i * 4 + 2])));
+        m = _mm_add_ps(m, _mm_mul_ps(column3, _mm_set1_ps(right[i * 4 + 3])));
+        _mm_storeu_ps(&result[i * 4], m);
+    }
+#else
+    GLfloat m[4 * 4];
+    for (GLuint i = 0; i < 4; i++) {
+        for (GLuint j = 0; j < 4; j++) {
+            m[j + i * 4] = left[j] * right[i * 4] + left[j + 4] * right[i * 4 + 1] +
+                left[j + 8] * right[i * 4 + 2] + left[j + 12] * right[i * 4 + 3];
+        }
+    }
+    std::memcpy(result, m, sizeof(m));
+#endif
+}
+
+class Matrix
+{
+    public:
+        enum class Rotation {
+            AxisX,
+            AxisY,
+            AxisZ
+        };
+
+        Matrix();
+        Matrix(const Matrix &source);
+        Matrix(Matrix &&source) noexcept;
+        Matrix(GLuint width, GLuint height);
+        Matrix(GLuint width, GLuint height, GLfloat *matrixData);
+
+        std::shared_ptr<GLfloat> &GetData();
+
+        void GetSize(GLuint &width, GLuint &height) const;
+        void SetSize(GLuint width, GLuint height);
+
+        Matrix operator+(const Matrix &matrix);
+        Matrix operator-(const Matrix &matrix);
+        Matrix operator*(const Matrix &matrix);
+        Matrix &operator=(const Matrix &source);
+        Matrix &operator=(const GLfloat *sourceData);
+
+        static Matrix GeneratePerpective(GLfloat width, GLfloat height, GLfloat nearPane, GLfloat farPane);
+        static Matrix GeneratePosition(GLfloat x, GLfloat y, GLfloat z);
+        static Matrix GenerateScale(GLfloat x, GLfloat y, GLfloat z);
+        static Matrix GenerateRotation(GLfloat angle, Rotation type);
+    private:
+        std::shared_ptr<GLfloat> data;
+        GLuint width;
+        GLuint height;
+};
 
 Matrix::Matrix() :
     width(4), height(4)
@@ -978,14 +1710,10 @@ Matrix Matrix::operator*(const Matrix &matrix)
         throw std::runtime_error("Cannot multiply matrices - incompatible matrix dimensions");
     }
     Matrix result(matrix.width, height);
-    for (GLuint j = 0; j < result.height; j++) {
-        for (GLuint i = 0; i < result.width; i++) {
-            GLfloat m = 0.0f;
-            for (GLuint k = 0; k < width; k++) {
-                m += data.get()[j + k * height] * matrix.data.get()[k + i * matrix.height];
-            }
-            result.data.get()[j + i * result.height] = m;
-        }
+    if ((width == 4) && (height == 4) && (matrix.width == 4)) {
+        MultiplyMatrix4(data.get(), matrix.data.get(), result.data.get());
+    } else {
+        MultiplyMatrix(data.get(), width, height, matrix.data.get(), matrix.width, result.data.get());
     }
     return result;
 }
@@ -1031,401 +1759,1314 @@ void Matrix::SetSize(GLuint width, GLuint height)
     this->height = height;
 }
 
-struct CharAdvance
+class Mat4
 {
-    uint16_t character;
-    GLfloat advance;
+    public:
+        Mat4();
+        Mat4(const GLfloat *matrixData);
+
+        const GLfloat *GetData() const;
+
+        Mat4 operator*(const Mat4 &matrix) const;
+
+        static Mat4 GeneratePerpective(GLfloat width, GLfloat height, GLfloat nearPane, GLfloat farPane);
+        static Mat4 GeneratePosition(GLfloat x, GLfloat y, GLfloat z);
+        static Mat4 GenerateScale(GLfloat x, GLfloat y, GLfloat z);
+        static Mat4 GenerateTRS(GLfloat x, GLfloat y, GLfloat z, GLfloat scaleX, GLfloat scaleY, GLfloat scaleZ);
+        static Mat4 GenerateRotation(GLfloat angle, Matrix::Rotation type);
+        static void GenerateTransforms(const Mat4 &screen, const GLfloat *x, const GLfloat *y, const GLfloat *scaleX, const GLfloat *scaleY, unsigned count, GLfloat *transforms);
+    private:
+        enum class Kind {
+            Translate,
+            Scale,
+            TRS,
+            General
+        };
+
+        alignas(16) GLfloat data[4 * 4];
+        Kind kind;
+
+        Mat4(Kind kind);
+
+        static Mat4 ComposeAnyTRS(const Mat4 &left, const Mat4 &right);
+        static Mat4 ComposeTRSGeneral(const Mat4 &left, const Mat4 &right);
 };
 
-struct CharOffset
+static_assert(std::is_trivially_copyable<Mat4>::value, "Mat4 must be trivially copyable");
+
+Mat4::Mat4() :
+    kind(Kind::General)
 {
-    GLfloat left, top;
-};
+    std::memset(data, 0, sizeof(data));
+}
 
-struct CharSize
+Mat4::Mat4(const GLfloat *matrixData) :
+    kind(Kind::General)
 {
-    GLfloat width, height;
-};
+    std::memcpy(data, matrixData, sizeof(data));
+}
 
-struct TextureRect
+Mat4::Mat4(Kind kind) :
+    kind(kind)
 {
-    GLfloat left, top, width, height;
-};
+}
 
-class FontChar
+Mat4 Mat4::GeneratePerpective(GLfloat width, GLfloat height, GLfloat nearPane, GLfloat farPane)
 {
-    public:
-        FontChar(const std::string &code, GLfloat width, const CharOffset &offset, const TextureRect &rect, const CharSize &size);
+    Mat4 result;
 
-        std::string GetCode() const;
-        GLfloat GetWidth() const;
-        CharOffset GetOffset() const;
-        TextureRect GetRect() const;
-        CharSize GetSize() const;
-        void AddAdvance(CharAdvance advance);
-        GLfloat GetAdvance(uint16_t character) const;
-    private:
-        std::string code;
-        GLfloat width;
-        CharOffset offset;
-        TextureRect textureRect;
-        CharSize size;
-        std::vector<CharAdvance> advances;
-};
+    result.data[0] = 2.0f * nearPane / width;
+    result.data[5] = 2.0f * nearPane / height;
+    result.data[10] = -(farPane + nearPane) / (farPane - nearPane);
+    result.data[11] = -1.0f;
+    result.data[14] = -2.0f * farPane * nearPane / (farPane - nearPane);
 
-FontChar::FontChar(const std::string &code, GLfloat width, const CharOffset &offset, const TextureRect &rect, const CharSize &size) :
-    code(code), width(width), offset(offset), textureRect(rect), size(size)
-{
+    return result;
 }
 
-std::string FontChar::GetCode() const
+Mat4 Mat4::GeneratePosition(GLfloat x, GLfloat y, GLfloat z)
 {
-    return code;
+    Mat4 result = GenerateTRS(x, y, z, 1.0f, 1.0f, 1.0f);
+    result.kind = Kind::Translate;
+    return result;
 }
 
-GLfloat FontChar::GetWidth() const
+Mat4 Mat4::GenerateScale(GLfloat x, GLfloat y, GLfloat z)
 {
-    return width;
+    Mat4 result = GenerateTRS(0.0f, 0.0f, 0.0f, x, y, z);
+    result.kind = Kind::Scale;
+    return result;
+}
+
+Mat4 Mat4::GenerateTRS(GLfloat x, GLfloat y, GLfloat z, GLfloat scaleX, GLfloat scaleY, GLfloat scaleZ)
+{
+    Mat4 result(Kind::TRS);
+
+    result.data[0] = scaleX;
+    result.data[1] = 0.0f;
+    result.data[2] = 0.0f;
+    result.data[3] = 0.0f;
+    result.data[4] = 0.0f;
+    result.data[5] = scaleY;
+    result.data[6] = 0.0f;
+    result.data[7] = 0.0f;
+    result.data[8] = 0.0f;
+    result.data[9] = 0.0f;
+    result.data[10] = scaleZ;
+    result.data[11] = 0.0f;
+    result.data[12] = x;
+    result.data[13] = y;
+    result.data[14] = z;
+    result.data[15] = 1.0f;
+
+    return result;
 }
 
-CharOffset FontChar::GetOffset() const
+Mat4 Mat4::GenerateRotation(GLfloat angle, Matrix::Rotation type)
 {
-    return offset;
+    Mat4 result;
+
+    result.data[15] = 1.0f;
+    GLfloat sinAngle = static_cast<GLfloat>(sin(angle));
+    GLfloat cosAngle = static_cast<GLfloat>(cos(angle));
+
+    switch (type) {
+        case Matrix::Rotation::AxisX:
+            result.data[0] = 1.0f;
+            result.data[5] = cosAngle;
+            result.data[6] = sinAngle;
+            result.data[9] = -sinAngle;
+            result.data[10] = cosAngle;
+            break;
+        case Matrix::Rotation::AxisY:
+            result.data[0] = cosAngle;
+            result.data[2] = sinAngle;
+            result.data[5] = 1.0f;
+            result.data[8] = -sinAngle;
+            result.data[10] = cosAngle;
+            break;
+        case Matrix::Rotation::AxisZ:
+        default:
+            result.data[0] = cosAngle;
+            result.data[1] = sinAngle;
+            result.data[4] = -sinAngle;
+            result.data[5] = cosAngle;
+            result.data[10] = 1.0f;
+    }
+
+    return result;
+}
+
+void Mat4::GenerateTransforms(const Mat4 &screen, const GLfloat *x, const GLfloat *y, const GLfloat *scaleX, const GLfloat *scaleY, unsigned count, GLfloat *transforms)
+{
+    const GLfloat *data = screen.data;
+#if defined(MATRIX_SIMD_NEON)
+    float32x4_t column0 = vld1q_f32(&data[0]);
+    float32x4_t column1 = vld1q_f32(&data[4]);
+    float32x4_t column2 = vld1q_f32(&data[8]);
+    float32x4_t column3 = vld1q_f32(&data[12]);
+    for (unsigned i = 0; i < count; i++) {
+        GLfloat *transform = &transforms[i * 4 * 4];
+        vst1q_f32(&transform[0], vmulq_n_f32(column0, scaleX[i]));
+        vst1q_f32(&transform[4], vmulq_n_f32(column1, scaleY[i]));
+        vst1q_f32(&transform[8], column2);
+        vst1q_f32(&transform[12], vmlaq_n_f32(vmlaq_n_f32(column3, column0, x[i]), column1, y[i]));
+    }
+#elif defined(MATRIX_SIMD_SSE2)
+    __m128 column0 = _mm_loadu_ps(&data[0]);
+    __m128 column1 = _mm_loadu_ps(&data[4]);
+    __m128 column2 = _mm_loadu_ps(&data[8]);
+    __m128 column3 = _mm_loadu_ps(&data[12]);
+    for (unsigned i = 0; i < count; i++) {
+        GLfloat *transform = &transforms[i * 4 * 4];
+        _mm_storeu_ps(&transform[0], _mm_mul_ps(column0, _mm_set1_ps(scaleX[i])));
+        _mm_storeu_ps(&transform[4], _mm_mul_ps(column1, _mm_set1_ps(scaleY[i])));
+        _mm_storeu_ps(&transform[8], column2);
+        _mm_storeu_ps(&transform[12], _mm_add_ps(_mm_add_ps(column3, _mm_mul_ps(column0, _mm_set1_ps(x[i]))), _mm_mul_ps(column1, _mm_set1_ps(y[i]))));
+    }
+#else
+    for (unsigned i = 0; i < count; i++) {
+        GLfloat *transform = &transforms[i * 4 * 4];
+        for (unsigned j = 0; j < 4; j++) {
+            transform[j] = data[j] * scaleX[i];
+            transform[j + 4] = data[j + 4] * scaleY[i];
+            transform[j + 8] = data[j + 8];
+            transform[j + 12] = data[j] * x[i] + data[j + 4] * y[i] + data[j + 12];
+        }
+    }
+#endif
 }
 
-TextureRect FontChar::GetRect() const
+const GLfloat *Mat4::GetData() const
 {
-    return textureRect;
+    return data;
 }
 
-CharSize FontChar::GetSize() const
+Mat4 Mat4::operator*(const Mat4 &matrix) const
 {
-    return size;
+    if (matrix.kind != Kind::General) {
+        return ComposeAnyTRS(*this, matrix);
+    }
+    if (kind != Kind::General) {
+        return ComposeTRSGeneral(*this, matrix);
+    }
+    Mat4 result(Kind::General);
+    MultiplyMatrix4(data, matrix.data, result.data);
+    return result;
 }
 
-GLfloat FontChar::GetAdvance(uint16_t character) const
+Mat4 Mat4::ComposeAnyTRS(const Mat4 &left, const Mat4 &right)
 {
-    for (CharAdvance advance : advances) {
-        if (advance.character == character) {
-            return advance.advance;
-        }
+    Mat4 result(Kind::General);
+    if (left.kind != Kind::General) {
+        result.kind = (left.kind == right.kind) ? left.kind : Kind::TRS;
     }
-    return 0;
+#if defined(MATRIX_SIMD_NEON)
+    float32x4_t column0 = vld1q_f32(&left.data[0]);
+    float32x4_t column1 = vld1q_f32(&left.data[4]);
+    float32x4_t column2 = vld1q_f32(&left.data[8]);
+    float32x4_t column3 = vld1q_f32(&left.data[12]);
+    vst1q_f32(&result.data[0], vmulq_n_f32(column0, right.data[0]));
+    vst1q_f32(&result.data[4], vmulq_n_f32(column1, right.data[5]));
+    vst1q_f32(&result.data[8], vmulq_n_f32(column2, right.data[10]));
+    vst1q_f32(&result.data[12], vmlaq_n_f32(vmlaq_n_f32(vmlaq_n_f32(column3, column0, right.data[12]), column1, right.data[13]), column2, right.data[14]));
+#elif defined(MATRIX_SIMD_SSE2)
+    __m128 column0 = _mm_loadu_ps(&left.data[0]);
+    __m128 column1 = _mm_loadu_ps(&left.data[4]);
+    __m128 column2 = _mm_loadu_ps(&left.data[8]);
+    __m128 column3 = _mm_loadu_ps(&left.data[12]);
+    _mm_storeu_ps(&result.data[0], _mm_mul_ps(column0, _mm_set1_ps(right.data[0])));
+    _mm_storeu_ps(&result.data[4], _mm_mul_ps(column1, _mm_set1_ps(right.data[5])));
+    _mm_storeu_ps(&result.data[8], _mm_mul_ps(column2, _mm_set1_ps(right.data[10])));
+    column3 = _mm_add_ps(column3, _mm_mul_ps(column0, _mm_set1_ps(right.data[12])));
+    column3 = _mm_add_ps(column3, _mm_mul_ps(column1, _mm_set1_ps(right.data[13])));
+    _mm_storeu_ps(&result.data[12], _mm_add_ps(column3, _mm_mul_ps(column2, _mm_set1_ps(right.data[14]))));
+#else
+    for (GLuint j = 0; j < 4; j++) {
+        result.data[j] = left.data[j] * right.data[0];
+        result.data[j + 4] = left.data[j + 4] * right.data[5];
+        result.data[j + 8] = left.data[j + 8] * right.data[10];
+        result.data[j + 12] = left.data[j] * right.data[12] + left.data[j + 4] * right.data[13] +
+            left.data[j + 8] * right.data[14] + left.data[j + 12];
+    }
+#endif
+    return result;
 }
 
-void FontChar::AddAdvance(CharAdvance advance)
+Mat4 Mat4::ComposeTRSGeneral(const Mat4 &left, const Mat4 &right)
 {
-    advances.push_back(advance);
+    Mat4 result(Kind::General);
+#if defined(MATRIX_SIMD_NEON)
+    const GLfloat scale[4] = { left.data[0], left.data[5], left.data[10], 1.0f };
+    const GLfloat translation[4] = { left.data[12], left.data[13], left.data[14], 0.0f };
+    float32x4_t diagonal = vld1q_f32(scale);
+    float32x4_t offset = vld1q_f32(translation);
+    for (GLuint i = 0; i < 4; i++) {
+        float32x4_t column = vld1q_f32(&right.data[i * 4]);
+        vst1q_f32(&result.data[i * 4], vmlaq_n_f32(vmulq_f32(diagonal, column), offset, right.data[i * 4 + 3]));
+    }
+#elif defined(MATRIX_SIMD_SSE2)
+    __m128 diagonal = _mm_setr_ps(left.data[0], left.data[5], left.data[10], 1.0f);
+    __m128 offset = _mm_setr_ps(left.data[12], left.data[13], left.data[14], 0.0f);
+    for (GLuint i = 0; i < 4; i++) {
+        __m128 column = _mm_loadu_ps(&right.data[i * 4]);
+        _mm_storeu_ps(&result.data[i * 4], _mm_add_ps(_mm_mul_ps(diagonal, column), _mm_mul_ps(offset, _mm_set1_ps(right.data[i * 4 + 3]))));
+    }
+#else
+    for (GLuint i = 0; i < 4; i++) {
+        const GLfloat *column = &right.data[i * 4];
+        result.data[i * 4] = left.data[0] * column[0] + left.data[12] * column[3];
+        result.data[i * 4 + 1] = left.data[5] * column[1] + left.data[13] * column[3];
+        result.data[i * 4 + 2] = left.data[10] * column[2] + left.data[14] * column[3];
+        result.data[i * 4 + 3] = column[3];
+    }
+#endif
+    return result;
 }
 
-#define GL_FONT_TEXT_VERTICAL_CENTER 0x1
-#define GL_FONT_TEXT_HORIZONTAL_CENTER 0x2
+#define SPRITE_BATCH_LAYER_PARTICLES 0
+#define SPRITE_BATCH_LAYER_TEXT 1
 
-class Font
+struct SpriteVertex
+{
+    GLfloat x, y;
+    GLushort u, v, opacity, reserved;
+};
+
+class SpriteBatch
 {
     public:
-        Font(const std::string &filename, const std::shared_ptr<Texture> &texture, const std::shared_ptr<ShaderProgram> &shader);
-        Font(const Font &) = delete;
-        Font(Font &&) = delete;
-        Font &operator=(const Font &) = delete;
-        virtual ~Font();
+        enum class Blend {
+            None,
+            Alpha
+        };
+
+        SpriteBatch(const std::shared_ptr<ShaderProgram> &shader);
+        SpriteBatch(const SpriteBatch &) = delete;
+        SpriteBatch(SpriteBatch &&) = delete;
+        SpriteBatch &operator=(const SpriteBatch &) = delete;
 
-        void RenderText(const std::string &text, GLfloat left, GLfloat top, GLfloat height, GLfloat screenRatio, GLuint hookType) const;
+        SpriteVertex *AddQuads(unsigned layer, GLuint texture, Blend blend, GLsizei quads, const std::shared_ptr<ShaderProgram> &shader = nullptr);
+        void AddBuffer(unsigned layer, GLuint texture, Blend blend, GLuint buffer, GLsizei quads, const std::shared_ptr<ShaderProgram> &shader = nullptr);
+        void Flush();
     private:
-        void AddCharacter(FontChar fontChar);
-        FontChar GetCharacter(std::string text, unsigned offset, uint16_t& index) const;
+        struct Run
+        {
+            unsigned layer;
+            GLuint program, texture, buffer;
+            Blend blend;
+            GLsizei firstVertex, quads;
+        };
+
+        struct Program
+        {
+            GLuint program, positionAttribute, textureAttribute, opacityAttribute, textureUniform;
+        };
+
+        GLuint AddShader(const std::shared_ptr<ShaderProgram> &shader);
+        const Program &GetProgram(GLuint program);
 
-        std::string name;
-        std::shared_ptr<Texture> texture;
         std::shared_ptr<ShaderProgram> shader;
-        GLuint vertexBuffer, textureBuffer, positionAttribute, textureAttribute, positionUniform, textureUniform, opacityUniform;
-        std::vector<FontChar> font;
+        std::vector<std::shared_ptr<ShaderProgram>> shaders;
+        std::vector<Program> programs;
+        std::vector<Run> runs;
+        std::vector<SpriteVertex> vertices, sortedVertices;
 };
 
-Font::Font(const std::string &filename, const std::shared_ptr<Texture> &texture, const std::shared_ptr<ShaderProgram> &shader) :
-    texture(texture), shader(shader)
+SpriteBatch::SpriteBatch(const std::shared_ptr<ShaderProgram> &shader) :
+    shader(shader)
 {
-    std::ifstream file;
-    uint16_t buffer[256];
-    file.open(filename, std::ifstream::binary);
-    if (!file.is_open()) {
-        throw std::runtime_error("Cannot open font file");
-    }
-    try {
-        file.read(reinterpret_cast<char*>(buffer), 4);
-        if ((file.rdstate() & std::ifstream::eofbit) || std::string(reinterpret_cast<char*>(buffer), 4) != "FONT") {
-            throw std::exception();
-        }
-        file.read(reinterpret_cast<char*>(buffer), sizeof(uint8_t));
-        if (file.rdstate() & std::ifstream::eofbit) {
-            throw std::exception();
-        }
-        uint8_t length = *(reinterpret_cast<uint8_t*>(buffer));
-        file.read(reinterpret_cast<char*>(buffer), length * sizeof(uint8_t));
-        if (file.rdstate() & std::ifstream::eofbit) {
-            throw std::exception();
-        }
-        name = std::string(reinterpret_cast<char*>(buffer), length * sizeof(uint8_t));
-        file.read(reinterpret_cast<char*>(buffer), sizeof(uint8_t));
-        if (file.rdstate() & std::ifstream::eofbit) {
-            throw std::exception();
-        }
-        uint8_t height = *(reinterpret_cast<uint8_t*>(buffer));
-        file.read(reinterpret_cast<char*>(buffer), sizeof(uint16_t));
-        if (file.rdstate() & std::ifstream::eofbit) {
-            throw std::exception();
-        }
-        uint16_t chars = *buffer;
-        for (uint16_t i = 0; i < chars; i++) {
-            file.read(reinterpret_cast<char*>(buffer), sizeof(uint8_t));
-            if (file.rdstate() & std::ifstream::eofbit) {
-                throw std::exception();
-            }
-            uint8_t size = *(reinterpret_cast<uint8_t*>(buffer));
-            file.read(reinterpret_cast<char*>(buffer), size * sizeof(uint8_t));
-            if (file.rdstate() & std::ifstream::eofbit) {
-                throw std::exception();
-            }
-            std::string code = std::string(reinterpret_cast<char*>(buffer), size * sizeof(uint8_t));
-            file.read(reinterpret_cast<char*>(buffer), sizeof(uint8_t));
-            if (file.rdstate() & std::ifstream::eofbit) {
-                throw std::exception();
-            }
-            GLfloat width = *(reinterpret_cast<uint8_t*>(buffer)) / static_cast<GLfloat>(height);
-            file.read(reinterpret_cast<char*>(buffer), 2 * sizeof(uint8_t));
-            if (file.rdstate() & std::ifstream::eofbit) {
-                throw std::exception();
-            }
-            CharOffset offset = {
-                (reinterpret_cast<int8_t*>(buffer))[0] / static_cast<GLfloat>(height),
-                (reinterpret_cast<int8_t*>(buffer))[1] / static_cast<GLfloat>(height)
-            };
-            file.read(reinterpret_cast<char*>(buffer), 4 * sizeof(uint16_t));
-            if (file.rdstate() & std::ifstream::eofbit) {
-                throw std::exception();
-            }
-            TextureRect textureRect = {
-                buffer[0] / static_cast<GLfloat>(texture->GetWidth()),
-                buffer[1] / static_cast<GLfloat>(texture->GetHeight()),
-                buffer[2] / static_cast<GLfloat>(texture->GetWidth()),
-                buffer[3] / static_cast<GLfloat>(texture->GetHeight())
-            };
-            CharSize dimensions = {
-                buffer[2] / static_cast<GLfloat>(height),
-                buffer[3] / static_cast<GLfloat>(height)
-            };
-            FontChar fontChar(code, width, offset, textureRect, dimensions);
-            file.read(reinterpret_cast<char*>(buffer), sizeof(uint16_t));
-            if (file.rdstate() & std::ifstream::eofbit) {
-                throw std::exception();
-            }
-            uint16_t advances = *buffer;
-            for (uint16_t j = 0; j < advances; j++) {
-                file.read(reinterpret_cast<char*>(buffer), sizeof(uint16_t));
-                if (file.rdstate() & std::ifstream::eofbit) {
-                    throw std::exception();
-                }
-                uint16_t character = *buffer;
-                file.read(reinterpret_cast<char*>(buffer), sizeof(uint8_t));
-                if (file.rdstate() & std::ifstream::eofbit) {
-                    throw std::exception();
-                }
-                fontChar.AddAdvance({
-                    character,
-                    *(reinterpret_cast<int8_t*>(buffer)) / static_cast<GLfloat>(height)
-                    });
-            }
-            AddCharacter(fontChar);
-        }
-        file.close();
-    } catch (...) {
-        file.close();
-        throw std::runtime_error("Cannot load font file, wrong file format");
-    }
-
-    positionAttribute = glGetAttribLocation(shader->GetProgram(), "vertexPosition");
-    textureAttribute = glGetAttribLocation(shader->GetProgram(), "vertexTexture");
-    positionUniform = glGetUniformLocation(shader->GetProgram(), "positionMatrix");
-    textureUniform = glGetUniformLocation(shader->GetProgram(), "texture");
-    opacityUniform = glGetUniformLocation(shader->GetProgram(), "opacity");
-
-    glGenBuffers(1, &vertexBuffer);
-    glGenBuffers(1, &textureBuffer);
 }
 
-Font::~Font()
+GLuint SpriteBatch::AddShader(const std::shared_ptr<ShaderProgram> &shader)
 {
-    glDeleteBuffers(1, &vertexBuffer);
-    glDeleteBuffers(1, &textureBuffer);
+    if (shader && (std::find(shaders.begin(), shaders.end(), shader) == shaders.end())) {
+        shaders.push_back(shader);
+    }
+    return (shader ? shader : this->shader)->GetProgram();
 }
 
-void Font::AddCharacter(FontChar fontChar)
+SpriteVertex *SpriteBatch::AddQuads(unsigned layer, GLuint texture, Blend blend, GLsizei quads, const std::shared_ptr<ShaderProgram> &shader)
 {
-    uint16_t begin = 0, end = static_cast<uint16_t>(font.size());
-    while (begin != end) {
-        uint16_t check = (begin + end) >> 1;
-        if (font[check].GetCode() < fontChar.GetCode()) {
-            begin = check + 1;
-        } else {
-            end = check;
-        }
+    GLuint program = AddShader(shader);
+    GLsizei firstVertex = static_cast<GLsizei>(vertices.size());
+    Run *last = runs.empty() ? nullptr : &runs.back();
+    if (last && (last->buffer == 0) && (last->layer == layer) && (last->program == program) && (last->texture == texture) && (last->blend == blend)) {
+        last->quads += quads;
+    } else {
+        runs.push_back({ layer, program, texture, 0, blend, firstVertex, quads });
     }
-    auto position = font.begin() + begin;
-    font.insert(position, fontChar);
+    vertices.resize(vertices.size() + quads * 4);
+    return &vertices[firstVertex];
 }
 
-FontChar Font::GetCharacter(std::string text, unsigned offset, uint16_t &index) const
+void SpriteBatch::AddBuffer(unsigned layer, GLuint texture, Blend blend, GLuint buffer, GLsizei quads, const std::shared_ptr<ShaderProgram> &shader)
 {
-    uint16_t begin = 0, end = static_cast<uint16_t>(font.size());
-    while (begin != end) {
-        uint16_t check = (begin + end) >> 1;
-        std::string code = font[check].GetCode();
-        if (code < text.substr(offset, code.size())) {
-            begin = check + 1;
-        }
-        else {
-            end = check;
+    runs.push_back({ layer, AddShader(shader), texture, buffer, blend, 0, quads });
+}
+
+const SpriteBatch::Program &SpriteBatch::GetProgram(GLuint program)
+{
+    for (const Program &binding : programs) {
+        if (binding.program == program) {
+            return binding;
         }
     }
-    if (begin >= font.size()) {
-        begin = 0;
-    }
-    index = begin;
-    return font[begin];
+    programs.push_back({
+        program,
+        static_cast<GLuint>(glGetAttribLocation(program, "vertexPosition")),
+        static_cast<GLuint>(glGetAttribLocation(program, "vertexTexture")),
+        static_cast<GLuint>(glGetAttribLocation(program, "vertexOpacity")),
+        static_cast<GLuint>(glGetUniformLocation(program, "texture"))
+    });
+    return programs.back();
 }
 
-void Font::RenderText(const std::string &text, GLfloat left, GLfloat top, GLfloat height, GLfloat screenRatio, GLuint hookType) const
+void SpriteBatch::Flush()
 {
-    GLfloat offsetLeft = 0.0f, offsetTop = 0.0f, renderWidth = 0.0f, renderHeight = 0.0f;
-    unsigned primitives = 0;
-    uint16_t lastCharIndex = 0xFFFF;
-    std::vector<GLfloat> vertexData, textureData;
-    for (unsigned i = 0; i < text.length(); i++) {
-        if (text[i] == '\n') {
-            offsetLeft = 0.0f;
-            offsetTop -= height;
-            continue;
-        }
+    if (runs.empty()) {
+        return;
+    }
 
-        uint16_t charIndex;
-        FontChar fontChar = GetCharacter(text, i, charIndex);
-        if (lastCharIndex != 0xFFFF) {
-            offsetLeft += fontChar.GetAdvance(lastCharIndex) * height;
+    std::stable_sort(runs.begin(), runs.end(), [](const Run &left, const Run &right) {
+        if (left.layer != right.layer) {
+            return left.layer < right.layer;
         }
-
-        TextureRect rect = fontChar.GetRect();
-        textureData.push_back(rect.left);
-        textureData.push_back(rect.top);
-        textureData.push_back(rect.left + rect.width);
-        textureData.push_back(rect.top);
-        textureData.push_back(rect.left + rect.width);
-        textureData.push_back(rect.top + rect.height);
-        textureData.push_back(rect.left);
-        textureData.push_back(rect.top);
-        textureData.push_back(rect.left + rect.width);
-        textureData.push_back(rect.top + rect.height);
-        textureData.push_back(rect.left);
-        textureData.push_back(rect.top + rect.height);
-
-        CharSize size = fontChar.GetSize();
-        CharOffset offset = fontChar.GetOffset();
-        vertexData.push_back(offsetLeft + offset.left * height);
-        vertexData.push_back(offsetTop - offset.top * height);
-        vertexData.push_back(0.0f);
-        vertexData.push_back(offsetLeft + (offset.left + size.width) * height);
-        vertexData.push_back(offsetTop - offset.top * height);
-        vertexData.push_back(0.0f);
-        vertexData.push_back(offsetLeft + (offset.left + size.width) * height);
-        vertexData.push_back(offsetTop - (offset.top + size.height) * height);
-        vertexData.push_back(0.0f);
-        vertexData.push_back(offsetLeft + offset.left * height);
-        vertexData.push_back(offsetTop - offset.top * height);
-        vertexData.push_back(0.0f);
-        vertexData.push_back(offsetLeft + (offset.left + size.width) * height);
-        vertexData.push_back(offsetTop - (offset.top + size.height) * height);
-        vertexData.push_back(0.0f);
-        vertexData.push_back(offsetLeft + offset.left * height);
-        vertexData.push_back(offsetTop - (offset.top + size.height) * height);
-        vertexData.push_back(0.0f);
-
-        offsetLeft += fontChar.GetWidth() * height;
-
-        if (offsetLeft > renderWidth) {
-            renderWidth = offsetLeft;
+        if (left.program != right.program) {
+            return left.program < right.program;
         }
-        if (-offsetTop > renderHeight) {
-            renderHeight = -offsetTop;
+        if (left.texture != right.texture) {
+            return left.texture < right.texture;
         }
+        return left.blend < right.blend;
+    });
+
+    sortedVertices.resize(vertices.size());
+    GLsizei offset = 0;
+    for (Run &run : runs) {
+        if (run.buffer == 0) {
+            std::memcpy(&sortedVertices[offset], &vertices[run.firstVertex], run.quads * 4 * sizeof(SpriteVertex));
+            run.firstVertex = offset;
+            offset += run.quads * 4;
+        }
+    }
 
-        i += static_cast<unsigned>(fontChar.GetCode().length()) - 1;
-        lastCharIndex = charIndex;
-        primitives += 2;
+    StreamBuffer &stream = StreamBuffer::GetInstance();
+    size_t position = 0;
+    if (!sortedVertices.empty()) {
+        position = stream.Write(sortedVertices.data(), sortedVertices.size() * sizeof(SpriteVertex));
     }
-    renderHeight += height;
 
-    glUseProgram(shader->GetProgram());
+    GLState &state = GLState::GetInstance();
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    state.ActiveTexture(GL_TEXTURE0);
+    for (size_t i = 0; i < runs.size();) {
+        const Run &run = runs[i];
+        GLsizei quads = run.quads;
+        size_t next = i + 1;
+        while ((next < runs.size()) && (run.buffer == 0) && (runs[next].buffer == 0) && (runs[next].program == run.program) && (runs[next].texture == run.texture) && (runs[next].blend == run.blend)) {
+            quads += runs[next++].quads;
+        }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture->GetTexture());
-    glUniform1i(textureUniform, 0);
+        const Program &program = GetProgram(run.program);
+        state.UseProgram(program.program);
+        glUniform1i(program.textureUniform, 0);
+        state.BindTexture(run.texture);
+        if (run.blend == Blend::Alpha) {
+            state.Enable(GL_BLEND);
+            state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        } else {
+            state.Disable(GL_BLEND);
+        }
+        state.SetVertexAttribArrays({ program.positionAttribute, program.textureAttribute, program.opacityAttribute });
+        state.BindBuffer(GL_ARRAY_BUFFER, run.buffer ? run.buffer : stream.GetBuffer());
+
+        size_t start = run.buffer ? 0 : position;
+        QuadIndexBuffer::GetInstance().Draw(quads, [&program, &run, start](GLsizei firstVertex) {
+            size_t base = start + (run.firstVertex + firstVertex) * sizeof(SpriteVertex);
+            glVertexAttribPointer(program.positionAttribute, 2, GL_FLOAT, GL_FALSE, sizeof(SpriteVertex), (GLvoid *)base);
+            glVertexAttribPointer(program.textureAttribute, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(SpriteVertex), (GLvoid *)(base + 2 * sizeof(GLfloat)));
+            glVertexAttribPointer(program.opacityAttribute, 1, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(SpriteVertex), (GLvoid *)(base + 2 * sizeof(GLfloat) + 2 * sizeof(GLushort)));
+        });
+        i = next;
+    }
 
-    Matrix position = Matrix::GeneratePosition(left - ((hookType & GL_FONT_TEXT_VERTICAL_CENTER) ? renderWidth / 2.0f : 0.0f), top + ((hookType & GL_FONT_TEXT_HORIZONTAL_CENTER) ? renderHeight / 2.0f : 0.0f), 0.0f);
-    glUniformMatrix4fv(positionUniform, 1, GL_FALSE, (Matrix::GenerateScale(1.0f / screenRatio, 1.0f, 0.0f) * position).GetData().get());
+    runs.clear();
+    vertices.clear();
+    shaders.clear();
+}
 
-    glUniform1f(opacityUniform, 1.0f);
+struct CharOffset
+{
+    GLfloat left, top;
+};
 
-    glEnableVertexAttribArray(positionAttribute);
-    glEnableVertexAttribArray(textureAttribute);
+struct CharSize
+{
+    GLfloat width, height;
+};
 
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(GLfloat), vertexData.data(), GL_STATIC_DRAW);
-    glVertexAttribPointer(positionAttribute, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid *)0);
+struct TextureRect
+{
+    GLfloat left, top, width, height;
+};
 
-    glBindBuffer(GL_ARRAY_BUFFER, textureBuffer);
-    glBufferData(GL_ARRAY_BUFFER, textureData.size() * sizeof(GLfloat), textureData.data(), GL_STATIC_DRAW);
-    glVertexAttribPointer(textureAttribute, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid *)0);
+#define UTF8_REPLACEMENT_CHARACTER 0xFFFD
 
-    glDrawArrays(GL_TRIANGLES, 0, primitives * 3);
+uint32_t DecodeUTF8(const std::string &text, unsigned &offset)
+{
+    uint8_t lead = static_cast<uint8_t>(text[offset++]);
+    if (lead < 0x80) {
+        return lead;
+    }
 
-    glDisableVertexAttribArray(positionAttribute);
-    glDisableVertexAttribArray(textureAttribute);
+    unsigned length;
+    uint32_t codepoint, minimum;
+    if ((lead & 0xE0) == 0xC0) {
+        length = 1;
+        codepoint = lead & 0x1F;
+        minimum = 0x80;
+    } else if ((lead & 0xF0) == 0xE0) {
+        length = 2;
+        codepoint = lead & 0x0F;
+        minimum = 0x800;
+    } else if ((lead & 0xF8) == 0xF0) {
+        length = 3;
+        codepoint = lead & 0x07;
+        minimum = 0x10000;
+    } else {
+        return UTF8_REPLACEMENT_CHARACTER;
+    }
 
-    glDisable(GL_BLEND);
+    if (offset + length > text.length()) {
+        return UTF8_REPLACEMENT_CHARACTER;
+    }
+    for (unsigned i = 0; i < length; i++) {
+        uint8_t continuation = static_cast<uint8_t>(text[offset + i]);
+        if ((continuation & 0xC0) != 0x80) {
+            return UTF8_REPLACEMENT_CHARACTER;
+        }
+        codepoint = (codepoint << 6) | (continuation & 0x3F);
+    }
+    if ((codepoint < minimum) || (codepoint > 0x10FFFF) || ((codepoint >= 0xD800) && (codepoint <= 0xDFFF))) {
+        return UTF8_REPLACEMENT_CHARACTER;
+    }
+    offset += length;
+    return codepoint;
 }
 
-struct Particle
+struct FontGlyph
 {
-    GLfloat opacity = 0, life = 0, lifeDelta = 0;
-    Matrix scale, position, delta;
+    uint32_t codepoint;
+    GLfloat width;
+    CharOffset offset;
+    CharSize size;
+    TextureRect rect;
 };
 
-class Background
+struct KerningPair
 {
-    public:
-        Background(const std::shared_ptr<Texture> &backgroundTexture, const std::shared_ptr<ShaderProgram> &backgroundShader, const std::shared_ptr<Texture> &particleTexture, const std::shared_ptr<ShaderProgram> &particleShader, GLfloat screenRatio);
-        Background(const Background &) = delete;
+    uint64_t pair;
+    GLfloat advance;
+    uint32_t reserved;
+};
+
+#define GL_FONT_BINARY_VERSION 1
+#define GL_FONT_BINARY_ALIGNMENT 8
+
+struct FontHeader
+{
+    char magic[4];
+    uint32_t version, size, height, glyphCount, kerningCount, hashSize, nameLength;
+    uint32_t glyphsOffset, kerningOffset, kerningLeftOffset, kerningRightOffset, directOffset, hashOffset, nameOffset, reserved;
+};
+
+static_assert(sizeof(FontGlyph) == 40, "FontGlyph layout must match the binary font format");
+static_assert(sizeof(KerningPair) == 16, "KerningPair layout must match the binary font format");
+static_assert(sizeof(FontHeader) == 64, "FontHeader layout must match the binary font format");
+
+class MappedFile
+{
+    public:
+        MappedFile(const std::string &filename);
+        MappedFile(const MappedFile &) = delete;
+        MappedFile(MappedFile &&) = delete;
+        MappedFile &operator=(const MappedFile &) = delete;
+        virtual ~MappedFile();
+
+        const uint8_t *GetData() const;
+        size_t GetSize() const;
+    private:
+        const uint8_t *data;
+        size_t size;
+#ifdef _WIN32
+        HANDLE file, mapping;
+#endif
+};
+
+MappedFile::MappedFile(const std::string &filename)
+{
+#ifndef _WIN32
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file == -1) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    struct stat status;
+    if ((fstat(file, &status) == -1) || (status.st_size <= 0)) {
+        close(file);
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    size = static_cast<size_t>(status.st_size);
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error("Cannot map file: " + filename);
+    }
+    data = static_cast<const uint8_t *>(mapped);
+#else
+    file = CreateFile(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize) || (fileSize.QuadPart <= 0)) {
+        CloseHandle(file);
+        throw std::runtime_error("Cannot open file: " + filename);
+    }
+    size = static_cast<size_t>(fileSize.QuadPart);
+    mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        throw std::runtime_error("Cannot map file: " + filename);
+    }
+    data = static_cast<const uint8_t *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (data == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        throw std::runtime_error("Cannot map file: " + filename);
+    }
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifndef _WIN32
+    munmap(const_cast<uint8_t *>(data), size);
+#else
+    UnmapViewOfFile(data);
+    CloseHandle(mapping);
+    CloseHandle(file);
+#endif
+}
+
+const uint8_t *MappedFile::GetData() const
+{
+    return data;
+}
+
+size_t MappedFile::GetSize() const
+{
+    return size;
+}
+
+#define GL_FONT_TEXT_VERTICAL_CENTER 0x1
+#define GL_FONT_TEXT_HORIZONTAL_CENTER 0x2
+#define GL_FONT_TEXT_CACHE_SIZE 32
+#define GL_FONT_DIRECT_GLYPHS 256
+#define GL_FONT_NO_GLYPH 0xFFFFFFFF
+
+struct TextLine
+{
+    GLfloat top, width;
+    GLsizei firstVertex, vertices;
+};
+
+struct TextGlyph
+{
+    unsigned offset;
+    GLfloat left, top;
+    uint32_t previousIndex;
+};
+
+struct TextVertex
+{
+    GLfloat x, y;
+    GLushort u, v;
+};
+
+struct TextLayout
+{
+    std::vector<TextVertex> vertices;
+    std::vector<TextLine> lines;
+    std::vector<TextGlyph> glyphs;
+    GLfloat width, height;
+};
+
+class Font
+{
+    public:
+        Font(const std::string &filename, const std::shared_ptr<Texture> &texture);
+        Font(const Font &) = delete;
+        Font(Font &&) = delete;
+        Font &operator=(const Font &) = delete;
+
+        void RenderText(SpriteBatch &batch, const std::string &text, GLfloat left, GLfloat top, GLfloat height, GLfloat screenRatio, GLuint hookType);
+        static std::vector<uint8_t> Compile(const uint8_t *source, size_t size);
+        static void Convert(const std::string &source, const std::string &destination);
+    private:
+        friend class TextBlock;
+
+        struct CachedText
+        {
+            std::string text;
+            GLfloat height, width, renderHeight, offsetX, offsetY, scaleX;
+            std::vector<TextVertex> vertices;
+            std::vector<SpriteVertex> sprites;
+        };
+
+        void Attach(const uint8_t *data, size_t size);
+        GLfloat GetKerning(uint32_t left, uint32_t right) const;
+        uint32_t GetCharacterIndex(uint32_t codepoint) const;
+        void LayoutText(const std::string &text, GLfloat height, TextLayout &layout, size_t firstGlyph = 0) const;
+        CachedText &GetCachedText(const std::string &text, GLfloat height);
+        static void TransformText(const TextVertex *vertices, size_t count, GLfloat offsetX, GLfloat offsetY, GLfloat scaleX, GLfloat scaleY, SpriteVertex *sprites);
+
+        std::string name;
+        std::shared_ptr<Texture> texture;
+        std::unique_ptr<MappedFile> mappedFile;
+        std::vector<uint8_t> fontData;
+        const FontHeader *header;
+        const FontGlyph *font;
+        const KerningPair *kerning;
+        const uint32_t *kerningLeft, *kerningRight, *directGlyphs, *glyphHash;
+        uint32_t fallbackGlyph;
+        GLfloat textureScaleX, textureScaleY;
+        std::list<CachedText> textCache;
+        TextLayout layout;
+};
+
+Font::Font(const std::string &filename, const std::shared_ptr<Texture> &texture) :
+    texture(texture)
+{
+    mappedFile.reset(new MappedFile(filename));
+    if ((mappedFile->GetSize() >= 4) && !std::memcmp(mappedFile->GetData(), "FONT", 4)) {
+        fontData = Compile(mappedFile->GetData(), mappedFile->GetSize());
+        mappedFile.reset();
+        Attach(fontData.data(), fontData.size());
+    } else {
+        Attach(mappedFile->GetData(), mappedFile->GetSize());
+    }
+
+    textureScaleX = 1.0f / texture->GetWidth();
+    textureScaleY = 1.0f / texture->GetHeight();
+}
+
+std::vector<uint8_t> Font::Compile(const uint8_t *source, size_t size)
+{
+    size_t position = 0;
+    auto read = [source, size, &position](size_t bytes) -> const uint8_t * {
+        if (position + bytes > size) {
+            throw std::runtime_error("Cannot load font file, wrong file format");
+        }
+        const uint8_t *data = source + position;
+        position += bytes;
+        return data;
+    };
+    auto readUint16 = [&read]() -> uint16_t {
+        const uint8_t *data = read(sizeof(uint16_t));
+        return static_cast<uint16_t>(data[0] | (data[1] << 8));
+    };
+
+    if (std::memcmp(read(4), "FONT", 4)) {
+        throw std::runtime_error("Cannot load font file, wrong file format");
+    }
+    uint8_t length = *read(sizeof(uint8_t));
+    std::string name(reinterpret_cast<const char *>(read(length)), length);
+    uint8_t height = *read(sizeof(uint8_t));
+    GLfloat scale = 1.0f / height;
+    uint16_t chars = readUint16();
+
+    std::vector<FontGlyph> loaded;
+    std::vector<std::pair<uint32_t, KerningPair>> loadedKerning;
+    loaded.reserve(chars);
+    for (uint16_t i = 0; i < chars; i++) {
+        uint8_t codeLength = *read(sizeof(uint8_t));
+        std::string code(reinterpret_cast<const char *>(read(codeLength)), codeLength);
+        unsigned codeOffset = 0;
+        FontGlyph glyph;
+        glyph.codepoint = code.empty() ? 0 : DecodeUTF8(code, codeOffset);
+        glyph.width = *read(sizeof(uint8_t)) * scale;
+        const int8_t *offset = reinterpret_cast<const int8_t *>(read(2 * sizeof(int8_t)));
+        glyph.offset = { offset[0] * scale, offset[1] * scale };
+        uint16_t rect[4];
+        for (uint16_t &value : rect) {
+            value = readUint16();
+        }
+        glyph.rect = { static_cast<GLfloat>(rect[0]), static_cast<GLfloat>(rect[1]), static_cast<GLfloat>(rect[2]), static_cast<GLfloat>(rect[3]) };
+        glyph.size = { rect[2] * scale, rect[3] * scale };
+        uint16_t advances = readUint16();
+        for (uint16_t j = 0; j < advances; j++) {
+            uint16_t character = readUint16();
+            loadedKerning.push_back({ i, { character, *reinterpret_cast<const int8_t *>(read(sizeof(int8_t))) * scale, 0 } });
+        }
+        loaded.push_back(glyph);
+    }
+    if (loaded.empty()) {
+        throw std::runtime_error("Cannot load font file, no glyphs defined");
+    }
+
+    std::vector<uint32_t> order(loaded.size()), sortedIndex(loaded.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&loaded](uint32_t left, uint32_t right) {
+        return loaded[left].codepoint < loaded[right].codepoint;
+    });
+    std::vector<FontGlyph> glyphs(loaded.size());
+    for (uint32_t i = 0; i < order.size(); i++) {
+        sortedIndex[order[i]] = i;
+        glyphs[i] = loaded[order[i]];
+    }
+
+    uint32_t bitmapWords = static_cast<uint32_t>((glyphs.size() + 31) / 32);
+    std::vector<uint32_t> kerningLeft(bitmapWords, 0), kerningRight(bitmapWords, 0);
+    std::vector<KerningPair> kerning;
+    for (const std::pair<uint32_t, KerningPair> &entry : loadedKerning) {
+        if (entry.second.pair >= glyphs.size()) {
+            continue;
+        }
+        uint32_t left = sortedIndex[entry.second.pair], right = sortedIndex[entry.first];
+        kerningLeft[left >> 5] |= 1u << (left & 31);
+        kerningRight[right >> 5] |= 1u << (right & 31);
+        kerning.push_back({ (static_cast<uint64_t>(left) << 32) | right, entry.second.advance, 0 });
+    }
+    std::sort(kerning.begin(), kerning.end(), [](const KerningPair &left, const KerningPair &right) {
+        return left.pair < right.pair;
+    });
+
+    std::vector<uint32_t> directGlyphs(GL_FONT_DIRECT_GLYPHS, GL_FONT_NO_GLYPH);
+    uint32_t hashSize = 1, hashed = 0;
+    for (uint32_t i = 0; i < glyphs.size(); i++) {
+        if (glyphs[i].codepoint < GL_FONT_DIRECT_GLYPHS) {
+            directGlyphs[glyphs[i].codepoint] = i;
+        } else {
+            hashed++;
+        }
+    }
+    while (hashSize < hashed * 2) {
+        hashSize <<= 1;
+    }
+    std::vector<uint32_t> glyphHash(hashSize, GL_FONT_NO_GLYPH);
+    for (uint32_t i = 0; i < glyphs.size(); i++) {
+        if (glyphs[i].codepoint >= GL_FONT_DIRECT_GLYPHS) {
+            uint32_t bucket = (glyphs[i].codepoint * 2654435761u) & (hashSize - 1);
+            while (glyphHash[bucket] != GL_FONT_NO_GLYPH) {
+                bucket = (bucket + 1) & (hashSize - 1);
+            }
+            glyphHash[bucket] = i;
+        }
+    }
+
+    FontHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, "GLFB", 4);
+    header.version = GL_FONT_BINARY_VERSION;
+    header.height = height;
+    header.glyphCount = static_cast<uint32_t>(glyphs.size());
+    header.kerningCount = static_cast<uint32_t>(kerning.size());
+    header.hashSize = hashSize;
+    header.nameLength = length;
+
+    std::vector<uint8_t> data;
+    auto append = [&data](const void *section, size_t bytes) -> uint32_t {
+        data.resize((data.size() + GL_FONT_BINARY_ALIGNMENT - 1) & ~static_cast<size_t>(GL_FONT_BINARY_ALIGNMENT - 1));
+        uint32_t offset = static_cast<uint32_t>(data.size());
+        if (bytes) {
+            data.resize(offset + bytes);
+            std::memcpy(&data[offset], section, bytes);
+        }
+        return offset;
+    };
+    append(&header, sizeof(header));
+    header.glyphsOffset = append(glyphs.data(), glyphs.size() * sizeof(FontGlyph));
+    header.kerningOffset = append(kerning.data(), kerning.size() * sizeof(KerningPair));
+    header.kerningLeftOffset = append(kerningLeft.data(), kerningLeft.size() * sizeof(uint32_t));
+    header.kerningRightOffset = append(kerningRight.data(), kerningRight.size() * sizeof(uint32_t));
+    header.directOffset = append(directGlyphs.data(), directGlyphs.size() * sizeof(uint32_t));
+    header.hashOffset = append(glyphHash.data(), glyphHash.size() * sizeof(uint32_t));
+    header.nameOffset = append(name.data(), name.size());
+    data.resize((data.size() + GL_FONT_BINARY_ALIGNMENT - 1) & ~static_cast<size_t>(GL_FONT_BINARY_ALIGNMENT - 1));
+    header.size = static_cast<uint32_t>(data.size());
+    std::memcpy(data.data(), &header, sizeof(header));
+    return data;
+}
+
+void Font::Convert(const std::string &source, const std::string &destination)
+{
+    MappedFile file(source);
+    std::vector<uint8_t> data = Compile(file.GetData(), file.GetSize());
+    std::ofstream output(destination, std::ofstream::binary | std::ofstream::trunc);
+    if (!output.is_open()) {
+        throw std::runtime_error("Cannot create font file: " + destination);
+    }
+    output.write(reinterpret_cast<const char *>(data.data()), data.size());
+    if (!output.good()) {
+        throw std::runtime_error("Cannot write font file: " + destination);
+    }
+}
+
+void Font::Attach(const uint8_t *data, size_t size)
+{
+    header = reinterpret_cast<const FontHeader *>(data);
+    if ((size < sizeof(FontHeader)) || std::memcmp(header->magic, "GLFB", 4)) {
+        throw std::runtime_error("Cannot load font file, wrong file format");
+    }
+    if (header->version != GL_FONT_BINARY_VERSION) {
+        throw std::runtime_error("Cannot load font file, unsupported format version");
+    }
+    uint32_t bitmapWords = (header->glyphCount + 31) / 32;
+    auto section = [data, size](uint32_t offset, uint64_t bytes) -> const uint8_t * {
+        if ((offset % GL_FONT_BINARY_ALIGNMENT) || (offset + bytes > size)) {
+            throw std::runtime_error("Cannot load font file, wrong file format");
+        }
+        return data + offset;
+    };
+    if ((header->size != size) || !header->glyphCount || !header->hashSize || (header->hashSize & (header->hashSize - 1))) {
+        throw std::runtime_error("Cannot load font file, wrong file format");
+    }
+    font = reinterpret_cast<const FontGlyph *>(section(header->glyphsOffset, static_cast<uint64_t>(header->glyphCount) * sizeof(FontGlyph)));
+    kerning = reinterpret_cast<const KerningPair *>(section(header->kerningOffset, static_cast<uint64_t>(header->kerningCount) * sizeof(KerningPair)));
+    kerningLeft = reinterpret_cast<const uint32_t *>(section(header->kerningLeftOffset, bitmapWords * sizeof(uint32_t)));
+    kerningRight = reinterpret_cast<const uint32_t *>(section(header->kerningRightOffset, bitmapWords * sizeof(uint32_t)));
+    directGlyphs = reinterpret_cast<const uint32_t *>(section(header->directOffset, GL_FONT_DIRECT_GLYPHS * sizeof(uint32_t)));
+    glyphHash = reinterpret_cast<const uint32_t *>(section(header->hashOffset, static_cast<uint64_t>(header->hashSize) * sizeof(uint32_t)));
+    name = std::string(reinterpret_cast<const char *>(section(header->nameOffset, header->nameLength)), header->nameLength);
+
+    for (uint32_t i = 0; i < GL_FONT_DIRECT_GLYPHS; i++) {
+        if ((directGlyphs[i] != GL_FONT_NO_GLYPH) && (directGlyphs[i] >= header->glyphCount)) {
+            throw std::runtime_error("Cannot load font file, wrong file format");
+        }
+    }
+    bool emptyBucket = false;
+    for (uint32_t i = 0; i < header->hashSize; i++) {
+        if (glyphHash[i] == GL_FONT_NO_GLYPH) {
+            emptyBucket = true;
+        } else if (glyphHash[i] >= header->glyphCount) {
+            throw std::runtime_error("Cannot load font file, wrong file format");
+        }
+    }
+    if (!emptyBucket) {
+        throw std::runtime_error("Cannot load font file, wrong file format");
+    }
+
+    fallbackGlyph = 0;
+    uint32_t replacement = GetCharacterIndex(UTF8_REPLACEMENT_CHARACTER);
+    if (font[replacement].codepoint == UTF8_REPLACEMENT_CHARACTER) {
+        fallbackGlyph = replacement;
+    } else if (directGlyphs['?'] != GL_FONT_NO_GLYPH) {
+        fallbackGlyph = directGlyphs['?'];
+    }
+}
+
+GLfloat Font::GetKerning(uint32_t left, uint32_t right) const
+{
+    if (!((kerningLeft[left >> 5] >> (left & 31)) & 1) || !((kerningRight[right >> 5] >> (right & 31)) & 1)) {
+        return 0.0f;
+    }
+    uint64_t pair = (static_cast<uint64_t>(left) << 32) | right;
+    const KerningPair *end = kerning + header->kerningCount;
+    const KerningPair *entry = std::lower_bound(kerning, end, pair, [](const KerningPair &kerning, uint64_t pair) {
+        return kerning.pair < pair;
+    });
+    return ((entry != end) && (entry->pair == pair)) ? entry->advance : 0.0f;
+}
+
+uint32_t Font::GetCharacterIndex(uint32_t codepoint) const
+{
+    if (codepoint < GL_FONT_DIRECT_GLYPHS) {
+        uint32_t index = directGlyphs[codepoint];
+        return (index != GL_FONT_NO_GLYPH) ? index : fallbackGlyph;
+    }
+    uint32_t bucket = (codepoint * 2654435761u) & (header->hashSize - 1);
+    for (uint32_t index = glyphHash[bucket]; index != GL_FONT_NO_GLYPH; index = glyphHash[bucket]) {
+        if (font[index].codepoint == codepoint) {
+            return index;
+        }
+        bucket = (bucket + 1) & (header->hashSize - 1);
+    }
+    return fallbackGlyph;
+}
+
+void Font::LayoutText(const std::string &text, GLfloat height, TextLayout &layout, size_t firstGlyph) const
+{
+    GLfloat offsetLeft = 0.0f, offsetTop = 0.0f;
+    uint32_t lastCharIndex = GL_FONT_NO_GLYPH;
+    unsigned i = 0;
+    if ((firstGlyph > 0) && (firstGlyph < layout.glyphs.size())) {
+        const TextGlyph &glyph = layout.glyphs[firstGlyph];
+        i = glyph.offset;
+        offsetLeft = glyph.left;
+        offsetTop = glyph.top;
+        lastCharIndex = glyph.previousIndex;
+        GLsizei firstVertex = static_cast<GLsizei>(firstGlyph * 4);
+        while (layout.lines.back().firstVertex > firstVertex) {
+            layout.lines.pop_back();
+        }
+        TextLine &line = layout.lines.back();
+        line.vertices = firstVertex - line.firstVertex;
+        line.width = line.vertices ? offsetLeft : 0.0f;
+        layout.glyphs.resize(firstGlyph);
+        layout.vertices.resize(firstGlyph * 4);
+    } else {
+        layout.glyphs.clear();
+        layout.vertices.clear();
+        layout.lines.assign(1, { 0.0f, 0.0f, 0, 0 });
+    }
+    layout.vertices.reserve(text.length() * 4);
+
+    auto texture = [](GLfloat value) -> GLushort {
+        return static_cast<GLushort>(max(0.0f, min(65535.0f, std::floor(value * 65535.0f + 0.5f))));
+    };
+
+    for (; i < text.length(); i++) {
+        if (text[i] == '\n') {
+            offsetLeft = 0.0f;
+            offsetTop -= height;
+            lastCharIndex = GL_FONT_NO_GLYPH;
+            layout.lines.push_back({ offsetTop, 0.0f, static_cast<GLsizei>(layout.vertices.size()), 0 });
+            continue;
+        }
+
+        layout.glyphs.push_back({ i, offsetLeft, offsetTop, lastCharIndex });
+
+        unsigned next = i;
+        uint32_t charIndex = GetCharacterIndex(DecodeUTF8(text, next));
+        const FontGlyph &fontChar = font[charIndex];
+        if (lastCharIndex != GL_FONT_NO_GLYPH) {
+            offsetLeft += GetKerning(lastCharIndex, charIndex) * height;
+        }
+
+        const TextureRect &rect = fontChar.rect;
+        const CharSize &size = fontChar.size;
+        const CharOffset &offset = fontChar.offset;
+        GLfloat charLeft = offsetLeft + offset.left * height, charRight = offsetLeft + (offset.left + size.width) * height;
+        GLfloat charTop = offsetTop - offset.top * height, charBottom = offsetTop - (offset.top + size.height) * height;
+        GLushort textureLeft = texture(rect.left * textureScaleX), textureRight = texture((rect.left + rect.width) * textureScaleX);
+        GLushort textureTop = texture(rect.top * textureScaleY), textureBottom = texture((rect.top + rect.height) * textureScaleY);
+        TextVertex glyphVertices[] = {
+            { charLeft, charTop, textureLeft, textureTop },
+            { charRight, charTop, textureRight, textureTop },
+            { charRight, charBottom, textureRight, textureBottom },
+            { charLeft, charBottom, textureLeft, textureBottom }
+        };
+        layout.vertices.insert(layout.vertices.end(), glyphVertices, glyphVertices + 4);
+
+        offsetLeft += fontChar.width * height;
+        layout.lines.back().width = offsetLeft;
+        layout.lines.back().vertices += 4;
+
+        i = next - 1;
+        lastCharIndex = charIndex;
+    }
+
+    layout.width = 0.0f;
+    layout.height = 0.0f;
+    for (const TextLine &line : layout.lines) {
+        layout.width = max(layout.width, line.width);
+        if (line.vertices) {
+            layout.height = max(layout.height, -line.top);
+        }
+    }
+    layout.height += height;
+}
+
+Font::CachedText &Font::GetCachedText(const std::string &text, GLfloat height)
+{
+    for (auto cached = textCache.begin(); cached != textCache.end(); cached++) {
+        if ((cached->height == height) && (cached->text == text)) {
+            if (cached != textCache.begin()) {
+                textCache.splice(textCache.begin(), textCache, cached);
+            }
+            return textCache.front();
+        }
+    }
+
+    if (textCache.size() < GL_FONT_TEXT_CACHE_SIZE) {
+        textCache.push_front(CachedText());
+    } else {
+        textCache.splice(textCache.begin(), textCache, std::prev(textCache.end()));
+    }
+
+    CachedText &cached = textCache.front();
+    cached.text = text;
+    cached.height = height;
+    LayoutText(text, height, layout);
+    cached.width = layout.width;
+    cached.renderHeight = layout.height;
+    cached.vertices.assign(layout.vertices.begin(), layout.vertices.end());
+    cached.sprites.clear();
+    return cached;
+}
+
+void Font::TransformText(const TextVertex *vertices, size_t count, GLfloat offsetX, GLfloat offsetY, GLfloat scaleX, GLfloat scaleY, SpriteVertex *sprites)
+{
+    for (size_t i = 0; i < count; i++) {
+        sprites[i].x = offsetX + vertices[i].x * scaleX;
+        sprites[i].y = offsetY + vertices[i].y * scaleY;
+        sprites[i].u = vertices[i].u;
+        sprites[i].v = vertices[i].v;
+        sprites[i].opacity = 0xFFFF;
+        sprites[i].reserved = 0;
+    }
+}
+
+void Font::RenderText(SpriteBatch &batch, const std::string &text, GLfloat left, GLfloat top, GLfloat height, GLfloat screenRatio, GLuint hookType)
+{
+    CachedText &cached = GetCachedText(text, height);
+    if (cached.vertices.empty()) {
+        return;
+    }
+    GLfloat scaleX = 1.0f / screenRatio;
+    GLfloat offsetX = (left - ((hookType & GL_FONT_TEXT_VERTICAL_CENTER) ? cached.width / 2.0f : 0.0f)) / screenRatio;
+    GLfloat offsetY = top + ((hookType & GL_FONT_TEXT_HORIZONTAL_CENTER) ? cached.renderHeight / 2.0f : 0.0f);
+    if (cached.sprites.empty() || (cached.offsetX != offsetX) || (cached.offsetY != offsetY) || (cached.scaleX != scaleX)) {
+        cached.offsetX = offsetX;
+        cached.offsetY = offsetY;
+        cached.scaleX = scaleX;
+        cached.sprites.resize(cached.vertices.size());
+        TransformText(cached.vertices.data(), cached.vertices.size(), offsetX, offsetY, scaleX, 1.0f, cached.sprites.data());
+    }
+    SpriteVertex *vertex = batch.AddQuads(SPRITE_BATCH_LAYER_TEXT, texture->GetTexture(), SpriteBatch::Blend::Alpha, static_cast<GLsizei>(cached.sprites.size() / 4));
+    std::memcpy(vertex, cached.sprites.data(), cached.sprites.size() * sizeof(SpriteVertex));
+}
+
+class TextBlock
+{
+    public:
+        TextBlock(Font &font, const std::string &text, GLfloat height, GLuint hookType);
+        TextBlock(const TextBlock &) = delete;
+        TextBlock(TextBlock &&) = delete;
+        TextBlock &operator=(const TextBlock &) = delete;
+        virtual ~TextBlock();
+
+        void SetText(const std::string &text);
+        const std::string &GetText() const;
+        GLfloat GetWidth() const;
+        GLfloat GetHeight() const;
+        const std::vector<TextLine> &GetLines() const;
+        bool IsDirty() const;
+        ScreenRect GetBounds(GLfloat left, GLfloat top, GLfloat screenRatio) const;
+        void AddDamage(DamageTracker &damage, GLfloat left, GLfloat top, GLfloat screenRatio) const;
+        void Submit(SpriteBatch &batch, GLfloat left, GLfloat top, GLfloat screenRatio);
+    private:
+        Font &font;
+        std::string text;
+        GLfloat height, spriteOffsetX, spriteOffsetY, spriteScaleX;
+        GLuint hookType, buffer;
+        size_t bufferSize;
+        TextLayout layout;
+        std::vector<SpriteVertex> sprites;
+        size_t firstStaleSprite;
+        ScreenRect drawnBounds;
+        bool dirty, drawn;
+};
+
+TextBlock::TextBlock(Font &font, const std::string &text, GLfloat height, GLuint hookType) :
+    font(font), height(height), spriteOffsetX(0.0f), spriteOffsetY(0.0f), spriteScaleX(0.0f), hookType(hookType), buffer(0), bufferSize(0), firstStaleSprite(0), dirty(true), drawn(false)
+{
+    glGenBuffers(1, &buffer);
+    font.LayoutText(text, height, layout);
+    this->text = text;
+}
+
+TextBlock::~TextBlock()
+{
+    GLState::GetInstance().InvalidateBuffer(buffer);
+    glDeleteBuffers(1, &buffer);
+}
+
+void TextBlock::SetText(const std::string &text)
+{
+    size_t changed = 0, length = min(text.length(), this->text.length());
+    while ((changed < length) && (text[changed] == this->text[changed])) {
+        changed++;
+    }
+    if ((changed == length) && (text.length() == this->text.length())) {
+        return;
+    }
+
+    size_t firstGlyph = layout.glyphs.size();
+    while ((firstGlyph > 0) && (layout.glyphs[firstGlyph - 1].offset > changed)) {
+        firstGlyph--;
+    }
+    if (firstGlyph > 0) {
+        firstGlyph--;
+    }
+
+    font.LayoutText(text, height, layout, firstGlyph);
+    this->text = text;
+    firstStaleSprite = min(firstStaleSprite, firstGlyph * 4);
+    dirty = true;
+}
+
+const std::string &TextBlock::GetText() const
+{
+    return text;
+}
+
+GLfloat TextBlock::GetWidth() const
+{
+    return layout.width;
+}
+
+GLfloat TextBlock::GetHeight() const
+{
+    return layout.height;
+}
+
+const std::vector<TextLine> &TextBlock::GetLines() const
+{
+    return layout.lines;
+}
+
+bool TextBlock::IsDirty() const
+{
+    return dirty;
+}
+
+ScreenRect TextBlock::GetBounds(GLfloat left, GLfloat top, GLfloat screenRatio) const
+{
+    if (layout.vertices.empty()) {
+        return { 0.0f, 0.0f, 0.0f, 0.0f };
+    }
+    GLfloat minX = layout.vertices[0].x, maxX = minX, minY = layout.vertices[0].y, maxY = minY;
+    for (const TextVertex &vertex : layout.vertices) {
+        minX = min(minX, vertex.x);
+        maxX = max(maxX, vertex.x);
+        minY = min(minY, vertex.y);
+        maxY = max(maxY, vertex.y);
+    }
+    GLfloat offsetX = (left - ((hookType & GL_FONT_TEXT_VERTICAL_CENTER) ? layout.width / 2.0f : 0.0f)) / screenRatio;
+    GLfloat offsetY = top + ((hookType & GL_FONT_TEXT_HORIZONTAL_CENTER) ? layout.height / 2.0f : 0.0f);
+    return { offsetX + minX / screenRatio, offsetY + minY, offsetX + maxX / screenRatio, offsetY + maxY };
+}
+
+void TextBlock::AddDamage(DamageTracker &damage, GLfloat left, GLfloat top, GLfloat screenRatio) const
+{
+    if (!dirty) {
+        return;
+    }
+    if (drawn) {
+        damage.Add(drawnBounds);
+    }
+    damage.Add(GetBounds(left, top, screenRatio));
+}
+
+void TextBlock::Submit(SpriteBatch &batch, GLfloat left, GLfloat top, GLfloat screenRatio)
+{
+    GLfloat scaleX = 1.0f / screenRatio;
+    GLfloat offsetX = (left - ((hookType & GL_FONT_TEXT_VERTICAL_CENTER) ? layout.width / 2.0f : 0.0f)) / screenRatio;
+    GLfloat offsetY = top + ((hookType & GL_FONT_TEXT_HORIZONTAL_CENTER) ? layout.height / 2.0f : 0.0f);
+    bool moved = (offsetX != spriteOffsetX) || (offsetY != spriteOffsetY) || (scaleX != spriteScaleX);
+    if (moved) {
+        spriteOffsetX = offsetX;
+        spriteOffsetY = offsetY;
+        spriteScaleX = scaleX;
+        firstStaleSprite = 0;
+    }
+    if (dirty || moved) {
+        drawnBounds = GetBounds(left, top, screenRatio);
+        drawn = true;
+        dirty = false;
+    }
+
+    sprites.resize(layout.vertices.size());
+    if (firstStaleSprite < sprites.size()) {
+        Font::TransformText(&layout.vertices[firstStaleSprite], sprites.size() - firstStaleSprite, offsetX, offsetY, scaleX, 1.0f, &sprites[firstStaleSprite]);
+
+        GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, buffer);
+        if (sprites.size() > bufferSize) {
+            bufferSize = sprites.capacity();
+            glBufferData(GL_ARRAY_BUFFER, bufferSize * sizeof(SpriteVertex), nullptr, GL_DYNAMIC_DRAW);
+            firstStaleSprite = 0;
+        }
+        glBufferSubData(GL_ARRAY_BUFFER, firstStaleSprite * sizeof(SpriteVertex), (sprites.size() - firstStaleSprite) * sizeof(SpriteVertex), &sprites[firstStaleSprite]);
+    }
+    firstStaleSprite = sprites.size();
+
+    if (!sprites.empty()) {
+        batch.AddBuffer(SPRITE_BATCH_LAYER_TEXT, font.texture->GetTexture(), SpriteBatch::Blend::Alpha, buffer, static_cast<GLsizei>(sprites.size() / 4));
+    }
+}
+
+struct ParticleSystem
+{
+    ParticleSystem(unsigned capacity);
+
+    unsigned capacity;
+    std::vector<GLfloat> x, y, previousX, previousY, dx, dy, scaleX, scaleY, opacity, life, lifeDelta;
+};
+
+ParticleSystem::ParticleSystem(unsigned capacity) :
+    capacity(capacity), x(capacity), y(capacity), previousX(capacity), previousY(capacity), dx(capacity), dy(capacity),
+    scaleX(capacity), scaleY(capacity), opacity(capacity), life(capacity), lifeDelta(capacity)
+{
+}
+
+static const GLfloat quadData[] = {
+    -1.0f, -1.0f, 0.0f, 1.0f,
+    1.0f, -1.0f, 1.0f, 1.0f,
+    1.0f, 1.0f, 1.0f, 0.0f,
+    -1.0f, 1.0f, 0.0f, 0.0f
+};
+
+class Background
+{
+    public:
+        enum class ParticleMode {
+            Uniform,
+            Batched,
+            PointSprite,
+            Gpu
+        };
+
+        Background(const std::shared_ptr<Texture> &backgroundTexture, const std::shared_ptr<ShaderProgram> &backgroundShader, const std::shared_ptr<Texture> &particleTexture, const std::shared_ptr<ShaderProgram> &particleShader, GLfloat screenRatio, unsigned particleCount, ParticleMode particleMode);
+        Background(const Background &) = delete;
         Background(Background &&) = delete;
         Background &operator=(const Background &) = delete;
         virtual ~Background();
 
-        void Render() const;
-        void Animate();
+        void Render(GLfloat interpolation, SpriteBatch &batch);
+        void Animate(GLfloat deltaTime);
+        bool IsDirty() const;
+        void AddDamage(DamageTracker &damage, GLfloat interpolation) const;
+
+        static bool IsPointSpriteSupported();
     private:
         std::shared_ptr<Texture> backgroundTexture, particleTexture;
         std::shared_ptr<ShaderProgram> backgroundShader, particleShader;
-        GLuint vertexBuffer, textureBuffer, backgroundVertexAttribute, backgroundTextureAttribute, backgroundTextureUniform, particleVertexAttribute;
+        GLuint quadBuffer, backgroundVertexAttribute, backgroundTextureAttribute, backgroundTextureUniform, particleVertexAttribute;
         GLuint particleTextureAttribute, particlePositionUniform, particleTextureUniform, particleOpacityUniform;
-        std::vector<Particle> particles;
-        GLfloat screenRatio;
-
-        void ResetParticle(Particle &particle, bool initial);
+        GLuint particleBuffer, particleOpacityAttribute, particleSizeAttribute, particleExtentAttribute;
+        GLuint particleMotionAttribute, particleShapeAttribute, particleLifeAttribute, particleTimeUniform, particleRatioUniform;
+        ParticleSystem particles;
+        ParticleMode particleMode;
+        std::vector<GLfloat> particleTransforms, particleVertices, renderX, renderY;
+        GLfloat screenRatio, viewportHeight;
+        double particleTime, previousParticleTime;
+        LayerCache layer;
+        bool dirty;
+
+        void RenderLayer();
+        void RenderParticlesUniform();
+        void SubmitParticles(SpriteBatch &batch);
+        void RenderParticlesPointSprite();
+        void RenderParticlesGpu(GLfloat interpolation);
+        void UseParticleProgram();
+        void UploadParticles();
+        void ResetParticle(unsigned index, bool initial);
 };
 
-Background::Background(const std::shared_ptr<Texture> &backgroundTexture, const std::shared_ptr<ShaderProgram> &backgroundShader, const std::shared_ptr<Texture> &particleTexture, const std::shared_ptr<ShaderProgram> &particleShader, GLfloat screenRatio)
-    : backgroundTexture(backgroundTexture), particleTexture(particleTexture), backgroundShader(backgroundShader), particleShader(particleShader), screenRatio(screenRatio)
+Background::Background(const std::shared_ptr<Texture> &backgroundTexture, const std::shared_ptr<ShaderProgram> &backgroundShader, const std::shared_ptr<Texture> &particleTexture, const std::shared_ptr<ShaderProgram> &particleShader, GLfloat screenRatio, unsigned particleCount, ParticleMode particleMode)
+    : backgroundTexture(backgroundTexture), particleTexture(particleTexture), backgroundShader(backgroundShader), particleShader(particleShader), particles(particleCount), particleMode(particleMode), particleTransforms(particleCount * 4 * 4), renderX(particleCount), renderY(particleCount), screenRatio(screenRatio), particleTime(0.0), previousParticleTime(0.0), layer(backgroundShader), dirty(true)
 {
     backgroundVertexAttribute = glGetAttribLocation(backgroundShader->GetProgram(), "vertexPosition");
     backgroundTextureAttribute = glGetAttribLocation(backgroundShader->GetProgram(), "vertexTexture");
@@ -1435,130 +3076,639 @@ Background::Background(const std::shared_ptr<Texture> &backgroundTexture, const
     particlePositionUniform = glGetUniformLocation(particleShader->GetProgram(), "positionMatrix");
     particleTextureUniform = glGetUniformLocation(particleShader->GetProgram(), "texture");
     particleOpacityUniform = glGetUniformLocation(particleShader->GetProgram(), "opacity");
+    particleOpacityAttribute = glGetAttribLocation(particleShader->GetProgram(), "vertexOpacity");
+    particleSizeAttribute = glGetAttribLocation(particleShader->GetProgram(), "vertexSize");
+    particleExtentAttribute = glGetAttribLocation(particleShader->GetProgram(), "vertexExtent");
+    particleMotionAttribute = glGetAttribLocation(particleShader->GetProgram(), "vertexMotion");
+    particleShapeAttribute = glGetAttribLocation(particleShader->GetProgram(), "vertexShape");
+    particleLifeAttribute = glGetAttribLocation(particleShader->GetProgram(), "vertexLife");
+    particleTimeUniform = glGetUniformLocation(particleShader->GetProgram(), "time");
+    particleRatioUniform = glGetUniformLocation(particleShader->GetProgram(), "screenRatio");
+
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    viewportHeight = static_cast<GLfloat>(viewport[3]);
+    layer.Resize(viewport[2], viewport[3]);
+
+    glGenBuffers(1, &quadBuffer);
+    glGenBuffers(1, &particleBuffer);
+
+    GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quadData), quadData, GL_STATIC_DRAW);
+
+    for (unsigned i = 0; i < particles.capacity; i++) {
+        ResetParticle(i, true);
+    }
 
-    glGenBuffers(1, &vertexBuffer);
-    glGenBuffers(1, &textureBuffer);
-
-    for (unsigned i = 0; i < NUMBER_OF_PARTICLES; i++) {
-        Particle particle;
-        ResetParticle(particle, true);
-        particles.push_back(particle);
+    if (particleMode == ParticleMode::Gpu) {
+        UploadParticles();
+        GLState::GetInstance().UseProgram(particleShader->GetProgram());
+        glUniform1f(particleRatioUniform, screenRatio);
     }
 }
 
 Background::~Background()
 {
-    glDeleteBuffers(1, &vertexBuffer);
-    glDeleteBuffers(1, &textureBuffer);
+    GLState &state = GLState::GetInstance();
+    state.InvalidateBuffer(quadBuffer);
+    state.InvalidateBuffer(particleBuffer);
+    glDeleteBuffers(1, &quadBuffer);
+    glDeleteBuffers(1, &particleBuffer);
 }
 
-void Background::Render() const
+bool Background::IsPointSpriteSupported()
 {
-    Matrix screen = Matrix::GenerateScale(1.0f / screenRatio, 1.0f, 1.0f);
-
-    GLfloat vertexData[] = {
-        -1.0f, -1.0f, 0.0f,
-        1.0f, 1.0f, 0.0f,
-        1.0f, -1.0f, 0.0f,
-        -1.0f, -1.0f, 0.0f,
-        -1.0f, 1.0f, 0.0f,
-        1.0f, 1.0f, 0.0f
-    };
-
-    GLfloat textureData[] = {
-        0.0f, 1.0f,
-        1.0f, 0.0f,
-        1.0f, 1.0f,
-        0.0f, 1.0f,
-        0.0f, 0.0f,
-        1.0f, 0.0f
-    };
+    GLint viewport[4];
+    GLfloat pointSizeRange[2];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    glGetFloatv(GL_ALIASED_POINT_SIZE_RANGE, pointSizeRange);
+    return pointSizeRange[1] >= PARTICLE_MAX_SCALE * viewport[3];
+}
 
-    glUseProgram(backgroundShader->GetProgram());
+void Background::RenderLayer()
+{
+    GLState &state = GLState::GetInstance();
+    state.UseProgram(backgroundShader->GetProgram());
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    state.Enable(GL_BLEND);
+    state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, backgroundTexture->GetTexture());
+    state.ActiveTexture(GL_TEXTURE0);
+    state.BindTexture(backgroundTexture->GetTexture());
     glUniform1i(backgroundTextureUniform, 0);
 
-    glEnableVertexAttribArray(backgroundVertexAttribute);
-    glEnableVertexAttribArray(backgroundTextureAttribute);
+    state.SetVertexAttribArrays({ backgroundVertexAttribute, backgroundTextureAttribute });
+
+    state.BindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+    glVertexAttribPointer(backgroundVertexAttribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid *)0);
+    glVertexAttribPointer(backgroundTextureAttribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid *)(2 * sizeof(GLfloat)));
 
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertexData), vertexData, GL_STATIC_DRAW);
-    glVertexAttribPointer(backgroundVertexAttribute, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid *)0);
+    QuadIndexBuffer::GetInstance().Draw(1, [](GLsizei) { });
+}
 
-    glBindBuffer(GL_ARRAY_BUFFER, textureBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(textureData), textureData, GL_STATIC_DRAW);
-    glVertexAttribPointer(backgroundTextureAttribute, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid *)0);
+void Background::Render(GLfloat interpolation, SpriteBatch &batch)
+{
+    Mat4 screen = Mat4::GenerateScale(1.0f / screenRatio, 1.0f, 1.0f);
 
-    glDrawArrays(GL_TRIANGLES, 0, 6);
+    layer.Draw([this]() {
+        RenderLayer();
+    });
+    dirty = false;
 
-    glDisableVertexAttribArray(backgroundVertexAttribute);
-    glDisableVertexAttribArray(backgroundTextureAttribute);
+    if (particleMode != ParticleMode::Gpu) {
+        for (unsigned i = 0; i < particles.capacity; i++) {
+            renderX[i] = particles.previousX[i] + (particles.x[i] - particles.previousX[i]) * interpolation;
+        }
+        for (unsigned i = 0; i < particles.capacity; i++) {
+            renderY[i] = particles.previousY[i] + (particles.y[i] - particles.previousY[i]) * interpolation;
+        }
+        Mat4::GenerateTransforms(screen, renderX.data(), renderY.data(), particles.scaleX.data(), particles.scaleY.data(), particles.capacity, particleTransforms.data());
+    }
 
-    glUseProgram(particleShader->GetProgram());
+    switch (particleMode) {
+        case ParticleMode::Uniform:
+            RenderParticlesUniform();
+            break;
+        case ParticleMode::Batched:
+            SubmitParticles(batch);
+            break;
+        case ParticleMode::PointSprite:
+            RenderParticlesPointSprite();
+            break;
+        case ParticleMode::Gpu:
+            RenderParticlesGpu(interpolation);
+            break;
+    }
+}
 
-    glBindTexture(GL_TEXTURE_2D, particleTexture->GetTexture());
+void Background::UseParticleProgram()
+{
+    GLState &state = GLState::GetInstance();
+    state.UseProgram(particleShader->GetProgram());
+    state.Enable(GL_BLEND);
+    state.BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    state.ActiveTexture(GL_TEXTURE0);
+    state.BindTexture(particleTexture->GetTexture());
     glUniform1i(particleTextureUniform, 0);
+}
 
-    glEnableVertexAttribArray(particleVertexAttribute);
-    glEnableVertexAttribArray(particleTextureAttribute);
+void Background::RenderParticlesUniform()
+{
+    UseParticleProgram();
 
-    for (unsigned i = 0; i < particles.size(); i++) {
-        glUniformMatrix4fv(particlePositionUniform, 1, GL_FALSE, (screen * particles[i].position * particles[i].scale).GetData().get());
+    GLState &state = GLState::GetInstance();
+    state.SetVertexAttribArrays({ particleVertexAttribute, particleTextureAttribute });
 
-        glUniform1f(particleOpacityUniform, particles[i].opacity * sin(particles[i].life * 3.14159265358979f));
+    state.BindBuffer(GL_ARRAY_BUFFER, quadBuffer);
+    glVertexAttribPointer(particleVertexAttribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid *)0);
+    glVertexAttribPointer(particleTextureAttribute, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid *)(2 * sizeof(GLfloat)));
 
-        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-        glVertexAttribPointer(particleVertexAttribute, 3, GL_FLOAT, GL_FALSE, 0, (GLvoid *)0);
+    for (unsigned i = 0; i < particles.capacity; i++) {
+        glUniformMatrix4fv(particlePositionUniform, 1, GL_FALSE, &particleTransforms[i * 4 * 4]);
 
-        glBindBuffer(GL_ARRAY_BUFFER, textureBuffer);
-        glVertexAttribPointer(particleTextureAttribute, 2, GL_FLOAT, GL_FALSE, 0, (GLvoid *)0);
+        glUniform1f(particleOpacityUniform, particles.opacity[i] * sin(particles.life[i] * 3.14159265358979f));
 
-        glDrawArrays(GL_TRIANGLES, 0, 6);
+        QuadIndexBuffer::GetInstance().Draw(1, [](GLsizei) { });
     }
+}
 
-    glDisableVertexAttribArray(particleVertexAttribute);
-    glDisableVertexAttribArray(particleTextureAttribute);
+void Background::SubmitParticles(SpriteBatch &batch)
+{
+    SpriteVertex *vertex = batch.AddQuads(SPRITE_BATCH_LAYER_PARTICLES, particleTexture->GetTexture(), SpriteBatch::Blend::Alpha, particles.capacity, particleShader);
+    for (unsigned i = 0; i < particles.capacity; i++) {
+        const GLfloat *transform = &particleTransforms[i * 4 * 4];
+        GLfloat opacity = particles.opacity[i] * static_cast<GLfloat>(sin(particles.life[i] * 3.14159265358979f));
+        GLushort packedOpacity = static_cast<GLushort>(max(0.0f, min(65535.0f, opacity * 65535.0f + 0.5f)));
+        for (unsigned j = 0; j < 4; j++) {
+            const GLfloat *corner = &quadData[j * 4];
+            vertex->x = transform[0] * corner[0] + transform[4] * corner[1] + transform[12];
+            vertex->y = transform[1] * corner[0] + transform[5] * corner[1] + transform[13];
+            vertex->u = static_cast<GLushort>(corner[2] * 65535.0f);
+            vertex->v = static_cast<GLushort>(corner[3] * 65535.0f);
+            vertex->opacity = packedOpacity;
+            vertex++;
+        }
+    }
+}
 
-    glDisable(GL_BLEND);
+void Background::RenderParticlesPointSprite()
+{
+    particleVertices.resize(particles.capacity * 6);
+    GLfloat *vertex = particleVertices.data();
+    for (unsigned i = 0; i < particles.capacity; i++) {
+        const GLfloat *transform = &particleTransforms[i * 4 * 4];
+        GLfloat size = max(particles.scaleX[i], particles.scaleY[i]);
+        vertex[0] = transform[12];
+        vertex[1] = transform[13];
+        vertex[2] = size * viewportHeight;
+        vertex[3] = size / particles.scaleX[i];
+        vertex[4] = size / particles.scaleY[i];
+        vertex[5] = particles.opacity[i] * static_cast<GLfloat>(sin(particles.life[i] * 3.14159265358979f));
+        vertex += 6;
+    }
+
+    UseParticleProgram();
+
+    GLState &state = GLState::GetInstance();
+#ifdef _WIN32
+    state.Enable(GL_VERTEX_PROGRAM_POINT_SIZE);
+    state.Enable(GL_POINT_SPRITE);
+#endif
+
+    state.SetVertexAttribArrays({ particleVertexAttribute, particleSizeAttribute, particleExtentAttribute, particleOpacityAttribute });
+
+    size_t base = StreamBuffer::GetInstance().Write(particleVertices.data(), particleVertices.size() * sizeof(GLfloat));
+    glVertexAttribPointer(particleVertexAttribute, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *)base);
+    glVertexAttribPointer(particleSizeAttribute, 1, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *)(base + 2 * sizeof(GLfloat)));
+    glVertexAttribPointer(particleExtentAttribute, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *)(base + 3 * sizeof(GLfloat)));
+    glVertexAttribPointer(particleOpacityAttribute, 1, GL_FLOAT, GL_FALSE, 6 * sizeof(GLfloat), (GLvoid *)(base + 5 * sizeof(GLfloat)));
+
+    glDrawArrays(GL_POINTS, 0, particles.capacity);
 }
 
-void Background::Animate()
+void Background::RenderParticlesGpu(GLfloat interpolation)
 {
-    for (unsigned i = 0; i < particles.size(); i++) {
-        particles[i].position = particles[i].position * particles[i].delta;
-        particles[i].life += particles[i].lifeDelta;
-        GLfloat *position = particles[i].position.GetData().get();
-        GLfloat *scale = particles[i].scale.GetData().get();
-        if (position[12] < -screenRatio - scale[0]) {
-            position[12] = screenRatio + scale[0];
+    UseParticleProgram();
+    glUniform1f(particleTimeUniform, static_cast<GLfloat>(previousParticleTime + (particleTime - previousParticleTime) * interpolation));
+
+    GLState &state = GLState::GetInstance();
+    state.SetVertexAttribArrays({ particleVertexAttribute, particleTextureAttribute, particleMotionAttribute, particleShapeAttribute, particleLifeAttribute });
+
+    state.BindBuffer(GL_ARRAY_BUFFER, particleBuffer);
+    QuadIndexBuffer::GetInstance().Draw(particles.capacity, [this](GLsizei firstVertex) {
+        size_t base = firstVertex * 14 * sizeof(GLfloat);
+        glVertexAttribPointer(particleVertexAttribute, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(GLfloat), (GLvoid *)base);
+        glVertexAttribPointer(particleTextureAttribute, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(GLfloat), (GLvoid *)(base + 2 * sizeof(GLfloat)));
+        glVertexAttribPointer(particleMotionAttribute, 4, GL_FLOAT, GL_FALSE, 14 * sizeof(GLfloat), (GLvoid *)(base + 4 * sizeof(GLfloat)));
+        glVertexAttribPointer(particleShapeAttribute, 4, GL_FLOAT, GL_FALSE, 14 * sizeof(GLfloat), (GLvoid *)(base + 8 * sizeof(GLfloat)));
+        glVertexAttribPointer(particleLifeAttribute, 2, GL_FLOAT, GL_FALSE, 14 * sizeof(GLfloat), (GLvoid *)(base + 12 * sizeof(GLfloat)));
+    });
+}
+
+void Background::UploadParticles()
+{
+    std::vector<GLfloat> vertexData(particles.capacity * 4 * 14);
+    GLfloat *vertex = vertexData.data();
+    for (unsigned i = 0; i < particles.capacity; i++) {
+        GLfloat elapsed = particles.life[i] / particles.lifeDelta[i];
+        GLfloat spawnY = (rand() % 200) / 100.0f - 0.66f;
+        for (unsigned j = 0; j < 4; j++) {
+            std::memcpy(vertex, &quadData[j * 4], 4 * sizeof(GLfloat));
+            vertex[4] = particles.x[i] - particles.dx[i] * elapsed;
+            vertex[5] = particles.y[i] - particles.dy[i] * elapsed;
+            vertex[6] = particles.dx[i];
+            vertex[7] = particles.dy[i];
+            vertex[8] = particles.scaleX[i];
+            vertex[9] = particles.scaleY[i];
+            vertex[10] = particles.opacity[i];
+            vertex[11] = spawnY;
+            vertex[12] = particles.life[i];
+            vertex[13] = particles.lifeDelta[i];
+            vertex += 14;
         }
-        if (position[12] > screenRatio + scale[0]) {
-            position[12] = -screenRatio - scale[0];
+    }
+
+    GLState::GetInstance().BindBuffer(GL_ARRAY_BUFFER, particleBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(GLfloat), vertexData.data(), GL_STATIC_DRAW);
+}
+
+bool Background::IsDirty() const
+{
+    return dirty || (particles.capacity > 0);
+}
+
+void Background::AddDamage(DamageTracker &damage, GLfloat interpolation) const
+{
+    if (!IsDirty()) {
+        return;
+    }
+    if (dirty || (particleMode == ParticleMode::Gpu)) {
+        damage.AddScreen();
+        return;
+    }
+    for (unsigned i = 0; i < particles.capacity; i++) {
+        GLfloat size = max(particles.scaleX[i], particles.scaleY[i]);
+        GLfloat x = particles.previousX[i] + (particles.x[i] - particles.previousX[i]) * interpolation;
+        GLfloat y = particles.previousY[i] + (particles.y[i] - particles.previousY[i]) * interpolation;
+        damage.Add({ (renderX[i] - size) / screenRatio, renderY[i] - size, (renderX[i] + size) / screenRatio, renderY[i] + size });
+        damage.Add({ (x - size) / screenRatio, y - size, (x + size) / screenRatio, y + size });
+    }
+}
+
+void Background::Animate(GLfloat deltaTime)
+{
+    if (particleMode == ParticleMode::Gpu) {
+        previousParticleTime = particleTime;
+        particleTime += deltaTime;
+        if (particleTime >= 2.0 * PARTICLE_TIME_PERIOD) {
+            particleTime -= PARTICLE_TIME_PERIOD;
+            previousParticleTime -= PARTICLE_TIME_PERIOD;
         }
-        if ((particles[i].life > 1.0f) || (position[13] < -1.0f - scale[5])) {
-            ResetParticle(particles[i], false);
+        return;
+    }
+
+    unsigned count = particles.capacity;
+    GLfloat ratio = screenRatio;
+    GLfloat *x = particles.x.data(), *y = particles.y.data(), *life = particles.life.data();
+    GLfloat *previousX = particles.previousX.data(), *previousY = particles.previousY.data();
+    const GLfloat *dx = particles.dx.data(), *dy = particles.dy.data(), *lifeDelta = particles.lifeDelta.data();
+    const GLfloat *scaleX = particles.scaleX.data(), *scaleY = particles.scaleY.data();
+
+    for (unsigned i = 0; i < count; i++) {
+        GLfloat bound = ratio + scaleX[i];
+        GLfloat position = x[i] + dx[i] * deltaTime;
+        GLfloat wrapped = (position < -bound) ? bound : position;
+        wrapped = (wrapped > bound) ? -bound : wrapped;
+        previousX[i] = (wrapped != position) ? wrapped : x[i];
+        x[i] = wrapped;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        previousY[i] = y[i];
+        y[i] += dy[i] * deltaTime;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        life[i] += lifeDelta[i] * deltaTime;
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        if ((life[i] > 1.0f) || (y[i] < -1.0f - scaleY[i])) {
+            ResetParticle(i, false);
         }
     }
 }
 
-void Background::ResetParticle(Particle &particle, bool initial)
+void Background::ResetParticle(unsigned index, bool initial)
 {
     GLfloat scale = (rand() % 40) / 100.0f + 0.4f;
     if (initial) {
-        particle.scale.SetSize(4, 4);
-        particle.life = (rand() % 100) / 100.0f;
+        particles.life[index] = (rand() % 100) / 100.0f;
+    }
+    particles.scaleX[index] = (1.0f + (rand() % 40) / 100.0f) * scale;
+    particles.scaleY[index] = scale;
+    particles.x[index] = ((rand() % 200) / 100.0f - 1.0f) * screenRatio;
+    particles.y[index] = initial ? (rand() % 200) / 100.0f - 1.0f : (rand() % 200) / 100.0f - 0.66f;
+    particles.previousX[index] = particles.x[index];
+    particles.previousY[index] = particles.y[index];
+    particles.dx[index] = (rand() % 20) / 100.0f - 0.1f;
+    particles.dy[index] = (rand() % 10) / 100.0f - 0.2f;
+    particles.opacity[index] = 0.05f + (rand() % 15) / 100.0f;
+    particles.life[index] = initial ? (rand() % 100) / 100.0f : 0.0f;
+    particles.lifeDelta[index] = (1 + rand() % 60) / 100.0f;
+}
+
+#ifdef MATRIX_BENCHMARK
+#define MATRIX_BENCHMARK_SIZE 1024
+#define MATRIX_BENCHMARK_ROUNDS 1000
+
+int BenchmarkMatrix()
+{
+    std::vector<Matrix> matrices;
+    std::vector<Mat4> matrices4, positions, scales;
+    std::vector<GLfloat> x, y, scaleX, scaleY;
+    for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE + 1; i++) {
+        GLfloat data[4 * 4];
+        for (unsigned j = 0; j < 4 * 4; j++) {
+            data[j] = (rand() % 2000) / 1000.0f - 1.0f;
+        }
+        matrices.push_back(Matrix(4, 4, data));
+        matrices4.push_back(Mat4(data));
+        positions.push_back(Mat4::GeneratePosition(data[0], data[1], 0.0f));
+        scales.push_back(Mat4::GenerateScale(data[3], data[4], 1.0f));
+        x.push_back(data[0]);
+        y.push_back(data[1]);
+        scaleX.push_back(data[3]);
+        scaleY.push_back(data[4]);
+    }
+    Mat4 screen = Mat4::GenerateScale(0.75f, 1.0f, 1.0f);
+
+    std::vector<GLfloat> generic(MATRIX_BENCHMARK_SIZE * 4 * 4), kernel(MATRIX_BENCHMARK_SIZE * 4 * 4);
+    auto measure = [&](const std::function<void()> &test) {
+        auto start = std::chrono::steady_clock::now();
+        for (unsigned round = 0; round < MATRIX_BENCHMARK_ROUNDS; round++) {
+            test();
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / (static_cast<double>(MATRIX_BENCHMARK_ROUNDS) * MATRIX_BENCHMARK_SIZE);
+    };
+
+    double genericTime = measure([&]() {
+        for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+            MultiplyMatrix(matrices[i].GetData().get(), 4, 4, matrices[i + 1].GetData().get(), 4, &generic[i * 4 * 4]);
+        }
+    });
+    double kernelTime = measure([&]() {
+        for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+            MultiplyMatrix4(matrices4[i].GetData(), matrices4[i + 1].GetData(), &kernel[i * 4 * 4]);
+        }
+    });
+    double matrixTime = measure([&]() {
+        for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+            std::memcpy(&generic[i * 4 * 4], (matrices[i] * matrices[i + 1]).GetData().get(), sizeof(GLfloat) * 4 * 4);
+        }
+    });
+    double mat4Time = measure([&]() {
+        for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+            std::memcpy(&kernel[i * 4 * 4], (matrices4[i] * matrices4[i + 1]).GetData(), sizeof(GLfloat) * 4 * 4);
+        }
+    });
+    double trsGenericTime = measure([&]() {
+        for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+            GLfloat position[4 * 4];
+            MultiplyMatrix(screen.GetData(), 4, 4, positions[i].GetData(), 4, position);
+            MultiplyMatrix(position, 4, 4, scales[i].GetData(), 4, &generic[i * 4 * 4]);
+        }
+    });
+    double trsTime = measure([&]() {
+        for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+            std::memcpy(&kernel[i * 4 * 4], (screen * positions[i] * scales[i]).GetData(), sizeof(GLfloat) * 4 * 4);
+        }
+    });
+    std::vector<GLfloat> batch(MATRIX_BENCHMARK_SIZE * 4 * 4);
+    double batchTime = measure([&]() {
+        Mat4::GenerateTransforms(screen, x.data(), y.data(), scaleX.data(), scaleY.data(), MATRIX_BENCHMARK_SIZE, batch.data());
+    });
+
+    GLfloat difference = 0.0f;
+    auto compare = [&](const GLfloat *expected, const GLfloat *actual) {
+        for (unsigned j = 0; j < 4 * 4; j++) {
+            difference = max(difference, static_cast<GLfloat>(fabs(expected[j] - actual[j])));
+        }
+    };
+    for (unsigned i = 0; i < MATRIX_BENCHMARK_SIZE; i++) {
+        GLfloat expected[4 * 4];
+        compare(&generic[i * 4 * 4], &kernel[i * 4 * 4]);
+        compare(&generic[i * 4 * 4], &batch[i * 4 * 4]);
+        MultiplyMatrix(matrices4[i].GetData(), 4, 4, matrices4[i + 1].GetData(), 4, expected);
+        compare(expected, (matrices4[i] * matrices4[i + 1]).GetData());
+        MultiplyMatrix(matrices4[i].GetData(), 4, 4, positions[i].GetData(), 4, expected);
+        compare(expected, (matrices4[i] * positions[i]).GetData());
+        MultiplyMatrix(scales[i].GetData(), 4, 4, matrices4[i].GetData(), 4, expected);
+        compare(expected, (scales[i] * matrices4[i]).GetData());
+    }
+
+    std::ostringstream result;
+    result << "4x4 matrix multiply, ns per product (" <<
+#if defined(MATRIX_SIMD_NEON)
+        "NEON"
+#elif defined(MATRIX_SIMD_SSE2)
+        "SSE2"
+#else
+        "scalar"
+#endif
+        << " kernel):" << std::endl;
+    result << "  generic loop:       " << genericTime << std::endl;
+    result << "  MultiplyMatrix4:    " << kernelTime << std::endl;
+    result << "  Matrix::operator*:  " << matrixTime << std::endl;
+    result << "  Mat4::operator*:    " << mat4Time << std::endl;
+    result << "screen * position * scale, ns per product:" << std::endl;
+    result << "  generic loop:       " << trsGenericTime << std::endl;
+    result << "  Mat4 TRS compose:   " << trsTime << std::endl;
+    result << "  GenerateTransforms: " << batchTime << std::endl;
+    result << "  max difference:     " << difference << std::endl;
+#ifndef _WIN32
+    std::cout << result.str();
+#else
+    MessageBox(NULL, result.str().c_str(), "Matrix benchmark", MB_OK);
+#endif
+    return 0;
+}
+#endif
+
+class SimulationClock
+{
+    public:
+        SimulationClock(GLfloat step);
+
+        unsigned Update();
+        GLfloat GetStep() const;
+        GLfloat GetInterpolation() const;
+    private:
+        std::chrono::steady_clock::time_point lastUpdate;
+        GLfloat step, accumulator;
+};
+
+SimulationClock::SimulationClock(GLfloat step) :
+    lastUpdate(std::chrono::steady_clock::now()), step(step), accumulator(0.0f)
+{
+}
+
+unsigned SimulationClock::Update()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::duration<GLfloat> elapsed = now - lastUpdate;
+    lastUpdate = now;
+    accumulator = min(accumulator + elapsed.count(), step * SIMULATION_MAX_STEPS);
+    unsigned steps = static_cast<unsigned>(accumulator / step);
+    accumulator -= steps * step;
+    return steps;
+}
+
+GLfloat SimulationClock::GetStep() const
+{
+    return step;
+}
+
+GLfloat SimulationClock::GetInterpolation() const
+{
+    return accumulator / step;
+}
+
+class FramePacer
+{
+    public:
+        enum class Mode {
+            VSync,
+            Capped,
+            Unthrottled
+        };
+
+        FramePacer(Mode mode, unsigned frameRate);
+
+        void Wait();
+    private:
+        Mode mode;
+        std::chrono::steady_clock::duration frameBudget;
+        std::chrono::steady_clock::time_point frameStart;
+};
+
+FramePacer::FramePacer(Mode mode, unsigned frameRate) :
+    mode(mode), frameBudget(std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / max(frameRate, 1u)))),
+    frameStart(std::chrono::steady_clock::now())
+{
+    Window &window = Window::GetInstance();
+    if (!window.SetSwapInterval((mode == Mode::VSync) ? 1 : 0) && (mode == Mode::VSync)) {
+        this->mode = Mode::Capped;
+    }
+}
+
+void FramePacer::Wait()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    std::chrono::steady_clock::duration frameTime = now - frameStart;
+    if ((mode == Mode::Capped) && (frameTime < frameBudget)) {
+        frameStart = now + (frameBudget - frameTime);
+        std::this_thread::sleep_until(frameStart);
+    } else {
+        frameStart = now;
+    }
+}
+
+class FrameStatistics
+{
+    public:
+        FrameStatistics();
+        void Update();
+    private:
+        std::chrono::steady_clock::time_point lastReport;
+        unsigned frames;
+        unsigned long issuedCalls, filteredCalls;
+};
+
+FrameStatistics::FrameStatistics() :
+    lastReport(std::chrono::steady_clock::now()), frames(0), issuedCalls(0), filteredCalls(0)
+{
+}
+
+void FrameStatistics::Update()
+{
+    GLState &state = GLState::GetInstance();
+    issuedCalls += state.GetIssuedCalls();
+    filteredCalls += state.GetFilteredCalls();
+    state.ResetStatistics();
+    frames++;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    GLfloat elapsed = std::chrono::duration<GLfloat>(now - lastReport).count();
+    if (elapsed < STATISTICS_INTERVAL) {
+        return;
+    }
+
+    std::ostringstream report;
+    report << "Frame time: " << elapsed * 1000.0f / frames << " ms, GL state calls per frame: "
+        << issuedCalls / frames << " issued, " << filteredCalls / frames << " filtered" << std::endl;
+#ifndef _WIN32
+    std::cout << report.str();
+#else
+    OutputDebugString(report.str().c_str());
+#endif
+
+    lastReport = now;
+    frames = 0;
+    issuedCalls = 0;
+    filteredCalls = 0;
+}
+
+struct Options
+{
+    unsigned particles = DEFAULT_NUMBER_OF_PARTICLES;
+    Background::ParticleMode particleMode = Background::ParticleMode::Batched;
+    FramePacer::Mode pacing = FramePacer::Mode::VSync;
+    unsigned frameRate = DEFAULT_FRAME_RATE;
+    bool statistics = false;
+    std::string convertFontSource, convertFontDestination;
+};
+
+unsigned ParseUnsigned(const std::string &option, const std::string &value, unsigned minimum)
+{
+    unsigned long result = 0;
+    for (char digit : value) {
+        if ((digit < '0') || (digit > '9') || (result > (0xFFFFFFFFul - (digit - '0')) / 10)) {
+            throw std::runtime_error(std::string("Invalid value for ") + option + std::string(": ") + value);
+        }
+        result = result * 10 + (digit - '0');
+    }
+    if (value.empty() || (result < minimum)) {
+        throw std::runtime_error(std::string("Invalid value for ") + option + std::string(": ") + value);
     }
-    particle.scale = Matrix::GenerateScale((1.0f + (rand() % 40) / 100.0f) * scale, scale, scale);
-    particle.position = Matrix::GeneratePosition(((rand() % 200) / 100.0f - 1.0f) * screenRatio, initial ? (rand() % 200) / 100.0f - 1.0f : (rand() % 200) / 100.0f - 0.66f, 0.0f);
-    particle.delta = Matrix::GeneratePosition((rand() % 20) / 10000.0f - 0.001f, (rand() % 10) / 10000.0f - 0.002f, 0.0f);
-    particle.opacity = 0.05f + (rand() % 15) / 100.0f;
-    particle.life = initial ? (rand() % 100) / 100.0f : 0.0f;
-    particle.lifeDelta = (1 + rand() % 60) / 10000.0f;
+    return static_cast<unsigned>(result);
+}
+
+Options ParseOptions(int argc, const char **argv)
+{
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string option(argv[i]);
+        auto value = [argc, argv, &i, &option]() -> std::string {
+            if (i + 1 >= argc) {
+                throw std::runtime_error(std::string("Missing value for ") + option);
+            }
+            return argv[++i];
+        };
+        if (option == "--particles") {
+            options.particles = ParseUnsigned(option, value(), 0);
+        } else if (option == "--particle-mode") {
+            std::string mode = value();
+            if (mode == "uniform") {
+                options.particleMode = Background::ParticleMode::Uniform;
+            } else if (mode == "batched") {
+                options.particleMode = Background::ParticleMode::Batched;
+            } else if (mode == "points") {
+                options.particleMode = Background::ParticleMode::PointSprite;
+            } else if (mode == "gpu") {
+                options.particleMode = Background::ParticleMode::Gpu;
+            } else {
+                throw std::runtime_error(std::string("Unknown particle mode: ") + mode);
+            }
+        } else if (option == "--pacing") {
+            std::string mode = value();
+            if (mode == "vsync") {
+                options.pacing = FramePacer::Mode::VSync;
+            } else if (mode == "none") {
+                options.pacing = FramePacer::Mode::Unthrottled;
+            } else {
+                options.pacing = FramePacer::Mode::Capped;
+                options.frameRate = ParseUnsigned(option, mode, 1);
+            }
+        } else if (option == "--stats") {
+            options.statistics = true;
+        } else if (option == "--convert-font") {
+            options.convertFontSource = value();
+            options.convertFontDestination = value();
+        } else {
+            throw std::runtime_error(std::string("Unknown command line option: ") + option);
+        }
+    }
+    return options;
 }
 
 bool quit = false;
@@ -1577,11 +3727,24 @@ int main(int argc, const char **argv)
 int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine, int nCmdShow)
 #endif
 {
+#ifdef MATRIX_BENCHMARK
+    return BenchmarkMatrix();
+#endif
+
 #ifndef _WIN32
     signal(SIGINT, signalHandler);
 #endif
 
     try {
+#ifndef _WIN32
+        Options options = ParseOptions(argc, argv);
+#else
+        Options options = ParseOptions(__argc, const_cast<const char **>(__argv));
+#endif
+        if (!options.convertFontSource.empty()) {
+            Font::Convert(options.convertFontSource, options.convertFontDestination);
+            return 0;
+        }
         Window &window = Window::GetInstance();
 
         unsigned width, height;
@@ -1590,35 +3753,79 @@ int WINAPI WinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, LPSTR lpCmdLine
         GLfloat screenRatio = width / static_cast<GLfloat>(height);
 
         std::shared_ptr<Texture> fontTexture(new Texture("images/euphemia.png"));
-        std::shared_ptr<ShaderProgram> fontShader(new ShaderProgram("shaders/particle.vs", "shaders/particle.fs", ShaderProgram::Source::File));
-        Font font("fonts/euphemia.fnt", fontTexture, fontShader);
+        Font font("fonts/euphemia.glf", fontTexture);
 
         std::shared_ptr<Texture> backgroundTexture(new Texture("images/background.png"));
         std::shared_ptr<ShaderProgram> backgroundShader(new ShaderProgram("shaders/background.vs", "shaders/background.fs", ShaderProgram::Source::File));
         std::shared_ptr<Texture> particleTexture(new Texture("images/particle.png"));
-        std::shared_ptr<ShaderProgram> particleShader(new ShaderProgram("shaders/particle.vs", "shaders/particle.fs", ShaderProgram::Source::File));
-        Background background(backgroundTexture, backgroundShader, particleTexture, particleShader, screenRatio);
-
+        if ((options.particleMode == Background::ParticleMode::PointSprite) && !Background::IsPointSpriteSupported()) {
+            options.particleMode = Background::ParticleMode::Batched;
+        }
+        std::shared_ptr<ShaderProgram> batchShader(new ShaderProgram("shaders/particle_batch.vs", "shaders/particle_batch.fs", ShaderProgram::Source::File));
+        std::shared_ptr<ShaderProgram> particleShader;
+        switch (options.particleMode) {
+            case Background::ParticleMode::Uniform:
+                particleShader.reset(new ShaderProgram("shaders/particle.vs", "shaders/particle.fs", ShaderProgram::Source::File));
+                break;
+            case Background::ParticleMode::Batched:
+                particleShader = batchShader;
+                break;
+            case Background::ParticleMode::PointSprite:
+                particleShader.reset(new ShaderProgram("shaders/particle_point.vs", "shaders/particle_point.fs", ShaderProgram::Source::File));
+                break;
+            case Background::ParticleMode::Gpu:
+                particleShader.reset(new ShaderProgram("shaders/particle_gpu.vs", "shaders/particle_batch.fs", ShaderProgram::Source::File));
+                break;
+        }
+        Background background(backgroundTexture, backgroundShader, particleTexture, particleShader, screenRatio, options.particles, options.particleMode);
+
+        SimulationClock clock(SIMULATION_STEP);
+        FramePacer pacer(options.pacing, options.frameRate);
+        FrameStatistics statistics;
+        SpriteBatch batch(batchShader);
+        DamageTracker damage(width, height);
+
+        TextBlock caption(
+            font,
+            "This is simple cross-platform OpenGL 2 demo.\n"
+            "Graphics and texts are generated real time.\n"
+            "This works both on Windows platform and\n"
+            "Raspberry Pi (with use of native OpenGL ES 2).",
+            0.125f,
+            GL_FONT_TEXT_VERTICAL_CENTER | GL_FONT_TEXT_HORIZONTAL_CENTER
+        );
+
+        bool redraw = true;
         while (!quit) {
-            switch (window.GetEvent()) {
+            switch (window.GetEvent(!redraw)) {
                 case Window::Event::NoEvent:
+                    for (unsigned steps = clock.Update(); steps > 0; steps--) {
+                        background.Animate(clock.GetStep());
+                    }
+                    background.AddDamage(damage, clock.GetInterpolation());
+                    caption.AddDamage(damage, 0.0f, 0.0f, screenRatio);
+                    if (damage.IsEmpty()) {
+                        redraw = false;
+                        break;
+                    }
+                    damage.Begin();
                     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
                     glClear(GL_COLOR_BUFFER_BIT);
-                    background.Render();
-                    font.RenderText(
-                        "This is simple cross-platform OpenGL 2 demo.\n"
-                        "Graphics and texts are generated real time.\n"
-                        "This works both on Windows platform and\n"
-                        "Raspberry Pi (with use of native OpenGL ES 2).",
-                        0.0f,
-                        0.0f,
-                        0.125f,
-                        screenRatio,
-                        GL_FONT_TEXT_VERTICAL_CENTER | GL_FONT_TEXT_HORIZONTAL_CENTER
-                    );
+                    background.Render(clock.GetInterpolation(), batch);
+                    caption.Submit(batch, 0.0f, 0.0f, screenRatio);
+                    batch.Flush();
+                    damage.End();
                     window.SwapBuffers();
-                    background.Animate();
-                    std::this_thread::sleep_for(std::chrono::microseconds(10000));
+                    StreamBuffer::GetInstance().NextFrame();
+                    if (options.statistics) {
+                        statistics.Update();
+                    }
+                    pacer.Wait();
+                    redraw = background.IsDirty() || caption.IsDirty();
+                    break;
+                case Window::Event::WindowExposed:
+                    damage.AddScreen();
+                    redraw = true;
                     break;
                 case Window::Event::KeyPressedEsc:
                 case Window::Event::WindowClosed:
@@ -0,0 +1,11 @@
+#version 100
+precision mediump float;
+uniform sampler2D texture;
+varying vec2 varyingTexture;
+varying float varyingOpacity;
+
+void main()
+{
+    vec4 sampled = texture2D(texture, varyingTexture);
+    gl_FragColor = vec4(1.0, 1.0, 1.0, (sampled.r + sampled.g + sampled.b) / 3.0 * varyingOpacity);
+}
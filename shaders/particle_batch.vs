@@ -0,0 +1,13 @@
+#version 100
+attribute vec2 vertexPosition;
+attribute vec2 vertexTexture;
+attribute float vertexOpacity;
+varying vec2 varyingTexture;
+varying float varyingOpacity;
+
+void main()
+{
+    gl_Position = vec4(vertexPosition, 0, 1);
+    varyingTexture = vertexTexture;
+    varyingOpacity = vertexOpacity;
+}
@@ -0,0 +1,24 @@
+#version 100
+uniform float time;
+uniform float screenRatio;
+attribute vec2 vertexPosition;
+attribute vec2 vertexTexture;
+attribute vec4 vertexMotion;
+attribute vec4 vertexShape;
+attribute vec2 vertexLife;
+varying vec2 varyingTexture;
+varying float varyingOpacity;
+
+void main()
+{
+    float age = vertexLife.x + vertexLife.y * time;
+    float cycle = floor(age);
+    float life = age - cycle;
+    vec2 start = vec2(vertexMotion.x + mod(cycle, 8.0) * 1.236068 * screenRatio, (cycle < 1.0) ? vertexMotion.y : vertexShape.w);
+    vec2 position = start + vertexMotion.zw * (life / vertexLife.y);
+    float bound = screenRatio + vertexShape.x;
+    position.x = mod(position.x + bound, 2.0 * bound) - bound;
+    gl_Position = vec4((position.x + vertexPosition.x * vertexShape.x) / screenRatio, position.y + vertexPosition.y * vertexShape.y, 0, 1);
+    varyingTexture = vertexTexture;
+    varyingOpacity = vertexShape.z * sin(life * 3.14159265) * step(-1.0 - vertexShape.y, position.y);
+}
@@ -0,0 +1,15 @@
+#version 100
+precision mediump float;
+uniform sampler2D texture;
+varying vec2 varyingExtent;
+varying float varyingOpacity;
+
+void main()
+{
+    vec2 coord = (gl_PointCoord - 0.5) * varyingExtent + 0.5;
+    if (any(lessThan(coord, vec2(0.0))) || any(greaterThan(coord, vec2(1.0)))) {
+        discard;
+    }
+    vec4 sampled = texture2D(texture, coord);
+    gl_FragColor = vec4(1.0, 1.0, 1.0, (sampled.r + sampled.g + sampled.b) / 3.0 * varyingOpacity);
+}
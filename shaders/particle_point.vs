@@ -0,0 +1,15 @@
+#version 100
+attribute vec2 vertexPosition;
+attribute float vertexSize;
+attribute vec2 vertexExtent;
+attribute float vertexOpacity;
+varying vec2 varyingExtent;
+varying float varyingOpacity;
+
+void main()
+{
+    gl_Position = vec4(vertexPosition, 0, 1);
+    gl_PointSize = vertexSize;
+    varyingExtent = vertexExtent;
+    varyingOpacity = vertexOpacity;
+}